@@ -0,0 +1,11 @@
+// buffer cache statistics, from bcachestat().
+struct bcstat {
+  uint64 hits;       // bget() found the block cached
+  uint64 misses;     // and didn't
+  uint64 evictions;  // valid blocks recycled for others
+  uint64 waits;      // bget() found the buffer locked
+  uint64 waitus;     // microseconds spent waiting for those
+  int nbuf;          // buffers in the cache
+  int nbusy;         // buffers with references
+  int npinned;       // referenced but not locked: by the log, or readahead
+};
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,50 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Each buffer is on the list of the bucket its (dev, blockno)
+// hashes to, and each bucket has its own lock, so looking up
+// different blocks doesn't contend. A block that isn't cached
+// takes a free buffer from whichever bucket it is in;
+// bcache.lock serializes only that.
+//
+// The choice of buffer follows 2Q, so that one pass over many
+// blocks doesn't push out the metadata that is used over and
+// over. A newly read block is "cold", and cold blocks are
+// evicted oldest first, however often they are used meanwhile,
+// once they are more than a quarter of the cache. bcache.ghost
+// remembers the blocks evicted cold; if one of those is read
+// again, it comes back "hot". hot blocks are evicted least
+// recently used first, only when there aren't enough cold ones.
+// build with BCACHELRU=1 for plain LRU instead, to compare.
+// buffers no one is using are on free lists in the order
+// they'd be evicted in: empty ones, cold ones by when they
+// were read, and hot ones by when they were released; so
+// finding a victim doesn't look at the rest of the cache.
+// each hart counts hits, misses, evictions and waits for
+// buffer locks, so counting doesn't bounce a cache line
+// between harts. ^P prints the totals, and the bcachestat
+// system call returns them.
+//
+// Buffers are allocated a page at a time. bcacheinit() sizes
+// the cache as a fraction of RAM, and the hash table to
+// match. when kalloc() runs out of memory it calls bshrink()
+// to give back a page of buffers that aren't in use, and
+// bget() grows the cache back when it misses and memory is
+// free again.
+//
+// File data is cached in pages by pcache.c instead. it
+// copies blocks that are already in the buffer cache with
+// bpeek(), and reads the rest of a page straight into the
+// page with brwn(). brw() reads and writes a single block
+// that isn't cached at all, for swap.
+//
+// bread_async() starts a read and returns without waiting
+// for it, so that a caller can have several under way at
+// once; bwait() waits for one. breadahead() starts a read
+// that nobody waits for: the disk holds a reference to the
+// buffer until the interrupt marks it valid, and whoever
+// breads the block meanwhile waits for that read.
 
 
 #include "types.h"
@@ -19,89 +63,663 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bcstat.h"
 
-struct {
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) % bcache.nbucket)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // list through prev/next
+};
+
+// a page of buffers.
+#define BPERPG ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+struct bpage {
+  struct bpage *next;
+  struct buf buf[BPERPG];
+};
+
+// the smallest the cache may shrink to, in pages; log.c
+// needs NBUF buffers.
+#define BMINPAGES ((NBUF + BPERPG - 1) / BPERPG)
+
+// per-hart counts; waittime is in time CSR ticks.
+// each hart's are in a cache line of their own.
+struct bstat {
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
+  uint64 waits;
+  uint64 waittime;
+} __attribute__((aligned(64)));
+
+// how many evicted blocks bcache.ghost remembers.
+#define NGHOST 512
+#define GHASH(dev, blockno) (((dev) * 31 + (blockno)) % NGHOST)
+
+// the free lists.
+#define BEMPTY 0
+#define BCOLD  1
+#define BHOT   2
+
+struct {
+  struct spinlock lock;  // held while recycling a buffer
+  struct bpage *pages;   // protected by lock
+  int npages;
+  int maxpages;          // what bcacheinit() sized the cache for
+  struct bucket *bucket; // a bucket per buffer it may hold
+  int nbucket;
+  uint clock;            // for buf.lastuse
+  int ncold;             // buffers holding cold blocks; protected by lock
+
+  // buffers with refcnt 0, each list circular from its
+  // head, which is evicted first. a bucket's lock is
+  // acquired before freelock.
+  struct spinlock freelock;
+  struct buf *free[3];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // blocks recently evicted cold, a ring, each also on
+  // the chain of ghosthash[GHASH()] through next. dev is
+  // 0 in an unused entry. protected by lock.
+  struct {
+    uint dev;
+    uint blockno;
+    short next;          // index, or -1
+  } ghost[NGHOST];
+  short ghosthash[NGHOST];
+  int ghostnext;
+
+  struct bstat *stat;    // ncpu of them
 } bcache;
 
+// add n to this hart's count of what.
+#define BSTAT(what, n) do { \
+    push_off(); \
+    bcache.stat[cpuid()].what += (n); \
+    pop_off(); \
+  } while(0)
+
+// the buffer for I/O that bypasses the cache.
+struct {
+  struct sleeplock lock;
+  struct buf buf;
+} braw;
+
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  if(b->next)
+    b->next->prev = b->prev;
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head;
+  b->prev = 0;
+  if(bk->head)
+    bk->head->prev = b;
+  bk->head = b;
+}
+
+// put b on free list l after a, or at the head if a is 0.
+static void
+finsert(int l, struct buf *a, struct buf *b)
+{
+  struct buf **h = &bcache.free[l];
+
+  b->freelist = l;
+  if(*h == 0){
+    b->fnext = b->fprev = b;
+    *h = b;
+    return;
+  }
+  if(a == 0){
+    a = (*h)->fprev;
+    *h = b;
+  }
+  b->fnext = a->fnext;
+  b->fprev = a;
+  a->fnext->fprev = b;
+  a->fnext = b;
+}
+
+static void
+fremove(struct buf *b)
+{
+  struct buf **h = &bcache.free[b->freelist];
+
+  if(b->fnext == b){
+    *h = 0;
+    return;
+  }
+  b->fprev->fnext = b->fnext;
+  b->fnext->fprev = b->fprev;
+  if(*h == b)
+    *h = b->fnext;
+}
+
+// put b, no longer in use, on its free list.
+// bcache.freelock must be held.
+static void
+bfree(struct buf *b)
+{
+  struct buf *a, *h;
+
+  if(!b->valid){
+    h = bcache.free[BEMPTY];
+    finsert(BEMPTY, h ? h->fprev : 0, b);
+  } else if(b->hot){
+    h = bcache.free[BHOT];
+    finsert(BHOT, h ? h->fprev : 0, b);
+  } else {
+    // in order of when read, from the newest end; a buffer
+    // is usually released soon after it was read.
+    h = bcache.free[BCOLD];
+    a = h ? h->fprev : 0;
+    while(a && (int)(a->lastuse - b->lastuse) > 0)
+      a = (a == h) ? 0 : a->fprev;
+    finsert(BCOLD, a, b);
+  }
+}
+
+// add a reference to b. its bucket's lock must be held.
+static void
+bhold(struct buf *b)
+{
+  if(b->refcnt++ == 0){
+    acquire(&bcache.freelock);
+    fremove(b);
+    release(&bcache.freelock);
+  }
+}
+
+// drop a reference to b. its bucket's lock must be held.
+static void
+bdrop(struct buf *b)
+{
+  if(b->refcnt < 1)
+    panic("bdrop");
+  if(--b->refcnt == 0){
+    acquire(&bcache.freelock);
+    bfree(b);
+    release(&bcache.freelock);
+  }
+}
+
+// add a page of buffers to the cache, holding no blocks.
+// they go in bucket 0, and brecycle() takes them first.
+// bcache.lock must be held.
+static void
+baddpage(struct bpage *pg)
+{
+  struct bucket *bk = &bcache.bucket[0];
+  struct buf *b;
+
+  memset(pg, 0, sizeof(*pg));
+  acquire(&bk->lock);
+  acquire(&bcache.freelock);
+  for(b = pg->buf; b < pg->buf+BPERPG; b++){
+    initsleeplock(&b->lock, "buffer");
+    blink(bk, b);
+    bfree(b);
+  }
+  release(&bcache.freelock);
+  release(&bk->lock);
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.npages++;
+}
+
+// Size the cache as a fraction of RAM, and allocate what
+// goes with it: a hash bucket for each buffer it may hold,
+// so chains stay short, and counts for each hart.
+// Called on hart 0 before kinit(), since binit() comes
+// too late for bootalloc().
+void
+bcacheinit(void)
+{
+  bcache.maxpages = (PHYSTOP - KERNBASE) / PGSIZE / BCACHEFRAC;
+  if(bcache.maxpages < BMINPAGES)
+    bcache.maxpages = BMINPAGES;
+  bcache.nbucket = bcache.maxpages * BPERPG;
+  bcache.bucket = bootalloc(bcache.nbucket * sizeof(struct bucket));
+  bcache.stat = bootalloc(ncpu * sizeof(struct bstat));
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct bpage *pg;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.freelock, "bcache.free");
+  initsleeplock(&braw.lock, "braw");
+  for(int i = 0; i < NGHOST; i++)
+    bcache.ghosthash[i] = -1;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(bk = bcache.bucket; bk < bcache.bucket+bcache.nbucket; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+
+  while(bcache.npages < bcache.maxpages && (pg = kalloc()) != 0){
+    acquire(&bcache.lock);
+    baddpage(pg);
+    release(&bcache.lock);
+  }
+  if(bcache.npages < BMINPAGES)
+    panic("binit");
+}
+
+// give back a page of buffers, if there is one with no
+// buffer in use and the cache is above its minimum size.
+// called by kalloc() when memory runs out.
+// returns 1 if it freed a page, 0 if not.
+int
+bshrink(void)
+{
+  struct bpage *pg, **pp;
+  struct bucket *bk;
+  struct buf *b;
+  int i, n;
+
+  acquire(&bcache.lock);
+  if(bcache.npages <= BMINPAGES){
+    release(&bcache.lock);
+    return 0;
+  }
+  for(pp = &bcache.pages; (pg = *pp) != 0; pp = &pg->next){
+    // claim each buffer in turn. with bcache.lock held,
+    // a free buffer's block, and so its bucket, can't change.
+    for(n = 0; n < BPERPG; n++){
+      b = &pg->buf[n];
+      bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+      acquire(&bk->lock);
+      if(b->refcnt != 0){
+        release(&bk->lock);
+        break;
+      }
+      bhold(b);
+      bunlink(bk, b);
+      release(&bk->lock);
+    }
+    if(n == BPERPG){
+      for(i = 0; i < n; i++)
+        if(pg->buf[i].dev && !pg->buf[i].hot)
+          bcache.ncold--;
+      *pp = pg->next;
+      bcache.npages--;
+      release(&bcache.lock);
+      kfree(pg);
+      return 1;
+    }
+    // one is in use; put back the ones claimed.
+    for(i = 0; i < n; i++){
+      b = &pg->buf[i];
+      bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+      acquire(&bk->lock);
+      blink(bk, b);
+      bdrop(b);
+      release(&bk->lock);
+    }
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
+// the cached buffer for the block in bucket bk, or 0.
+// bk->lock must be held.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// remove ghost entry i from its hash chain.
+// bcache.lock must be held.
+static void
+gunlink(int i)
+{
+  short *pp = &bcache.ghosthash[GHASH(bcache.ghost[i].dev, bcache.ghost[i].blockno)];
+
+  while(*pp != i)
+    pp = &bcache.ghost[*pp].next;
+  *pp = bcache.ghost[i].next;
+  bcache.ghost[i].dev = 0;
+}
+
+// remember that the block was evicted cold, in place of
+// the oldest one remembered. bcache.lock must be held.
+static void
+gadd(uint dev, uint blockno)
+{
+  int i = bcache.ghostnext;
+  short *h = &bcache.ghosthash[GHASH(dev, blockno)];
+
+  if(bcache.ghost[i].dev)
+    gunlink(i);
+  bcache.ghost[i].dev = dev;
+  bcache.ghost[i].blockno = blockno;
+  bcache.ghost[i].next = *h;
+  *h = i;
+  bcache.ghostnext = (i + 1) % NGHOST;
+}
+
+// was the block evicted cold lately? if so, forget it.
+// bcache.lock must be held.
+static int
+bghost(uint dev, uint blockno)
+{
+  for(int i = bcache.ghosthash[GHASH(dev, blockno)]; i >= 0; i = bcache.ghost[i].next){
+    if(bcache.ghost[i].blockno == blockno && bcache.ghost[i].dev == dev){
+      gunlink(i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// take a free buffer out of its bucket, and return it with
+// a reference: one holding no block if there is one, else
+// the oldest cold one if there are too many cold ones, else
+// the least recently used hot one. returns 0 if every
+// buffer is in use.
+// bcache.lock must be held.
+static struct buf*
+brecycle(void)
+{
+  struct bucket *bk;
+  struct buf *victim, **f = bcache.free;
+
+  for(;;){
+    acquire(&bcache.freelock);
+    if(f[BEMPTY])
+      victim = f[BEMPTY];
+    else if(f[BCOLD] && (bcache.ncold > bcache.npages * BPERPG / 4 || f[BHOT] == 0))
+      victim = f[BCOLD];
+    else
+      victim = f[BHOT];
+    release(&bcache.freelock);
+    if(victim == 0)
+      return 0;
+
+    // with bcache.lock held, the victim's block can't
+    // change, but someone may pick it up meanwhile.
+    bk = &bcache.bucket[HASH(victim->dev, victim->blockno)];
+    acquire(&bk->lock);
+    if(victim->refcnt == 0){
+      bhold(victim);
+      if(victim->dev && !victim->hot)
+        bcache.ncold--;
+      if(victim->valid){
+        BSTAT(evictions, 1);
+        if(!victim->hot)
+          gadd(victim->dev, victim->blockno);
+      }
+      victim->valid = 0;
+      bunlink(bk, victim);
+      release(&bk->lock);
+      return victim;
+    }
+    release(&bk->lock);
+  }
+}
+
+// lock b, counting any time spent waiting for someone
+// else to finish with it.
+static void
+block(struct buf *b)
+{
+  uint64 t0;
+
+  // a racy look, but it's only for the counts.
+  if(!b->lock.locked){
+    acquiresleep(&b->lock);
+    return;
   }
+  t0 = r_time();
+  acquiresleep(&b->lock);
+  BSTAT(waits, 1);
+  BSTAT(waittime, r_time() - t0);
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// for readahead, return 0 instead of waiting for a cached
+// block or of panicking when every buffer is in use.
 static struct buf*
-bget(uint dev, uint blockno)
+bget1(uint dev, uint blockno, int ahead)
 {
+  struct bucket *bk = &bcache.bucket[HASH(dev, blockno)];
+  struct bpage *pg;
   struct buf *b;
 
-  acquire(&bcache.lock);
-
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(ahead){
+      release(&bk->lock);
+      return 0;
     }
+    bhold(b);
+    release(&bk->lock);
+    BSTAT(hits, 1);
+    block(b);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached. grow the cache if it has shrunk and memory
+  // is free again; not by reclaiming, which would only give
+  // back cached blocks or file pages for empty buffers.
+  // ktryalloc() can't be called holding bcache locks.
+  pg = 0;
+  if(bcache.npages < bcache.maxpages)
+    pg = ktryalloc();
+
+  // Only one process at a time recycles a buffer, so look
+  // again in case one cached the block while we waited.
+  acquire(&bcache.lock);
+  if(pg && bcache.npages < bcache.maxpages){
+    baddpage(pg);
+    pg = 0;
+  }
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(!ahead)
+      bhold(b);
+    release(&bk->lock);
+    release(&bcache.lock);
+    if(pg)
+      kfree(pg);
+    if(ahead)
+      return 0;
+    BSTAT(hits, 1);
+    block(b);
+    return b;
+  }
+  release(&bk->lock);
+
+  if((b = brecycle()) == 0){
+    if(!ahead)
+      panic("bget: no buffers");
+    release(&bcache.lock);
+    if(pg)
+      kfree(pg);
+    return 0;
   }
-  panic("bget: no buffers");
+  BSTAT(misses, 1);
+  b->dev = dev;
+  b->blockno = blockno;
+  // cold blocks age from when they were read.
+  b->lastuse = bcache.clock++;
+#ifdef BCACHELRU
+  // everything on the hot list: plain LRU.
+  b->hot = 1;
+#else
+  b->hot = bghost(dev, blockno);
+#endif
+  if(!b->hot)
+    bcache.ncold++;
+  acquire(&bk->lock);
+  blink(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+  if(pg)
+    kfree(pg);
+  acquiresleep(&b->lock);
+  return b;
 }
 
-// Return a locked buf with the contents of the indicated block.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  return bget1(dev, blockno, 0);
+}
+
+// Return a locked buf for the indicated block, with a read
+// of it under way if it isn't valid yet. call bwait() before
+// looking at the data.
 struct buf*
-bread(uint dev, uint blockno)
+bread_async(uint dev, uint blockno)
 {
   struct buf *b;
 
   b = bget(dev, blockno);
-  if(!b->valid) {
+  if(!b->valid && !b->disk){
+    b->reading = 1;
+    virtio_disk_start(b, 0);
+  }
+  return b;
+}
+
+// Wait for a locked buf's data to be valid: for the read
+// that bread_async() or breadahead() started, or for one
+// this starts if there was none.
+void
+bwait(struct buf *b)
+{
+  if(b->valid)
+    return;
+  virtio_disk_wait(b);
+  if(b->reading){
+    b->reading = 0;
+    b->valid = 1;
+  } else if(!b->valid){
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
+}
+
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bread_async(dev, blockno);
+  bwait(b);
+  return b;
+}
+
+// Return a locked buf for the indicated block without
+// reading it, for a caller that will overwrite all of it.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->disk)
+    virtio_disk_wait(b);
+  b->reading = 0;
+  b->valid = 1;
   return b;
 }
 
+// Start reading the indicated block into the cache, for
+// someone to bread() soon, and don't wait for it. the disk
+// holds a reference to the buf until the read is done.
+// only a hint: does nothing if the block is already cached,
+// or if every buffer is in use.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget1(dev, blockno, 1)) == 0)
+    return;
+  b->async = 1;
+  virtio_disk_start(b, 0);
+  releasesleep(&b->lock);
+}
+
+// If block blockno of dev is cached, copy it to dst and
+// return 1; it may be newer there than on disk. If not,
+// return 0.
+int
+bpeek(uint dev, uint blockno, char *dst)
+{
+  struct bucket *bk = &bcache.bucket[HASH(dev, blockno)];
+  struct buf *b;
+
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) == 0){
+    release(&bk->lock);
+    return 0;
+  }
+  bhold(b);
+  release(&bk->lock);
+  BSTAT(hits, 1);
+  block(b);
+  bwait(b);
+  memmove(dst, b->data, BSIZE);
+  brelse(b);
+  return 1;
+}
+
+// Read or write the n blocks of dev from blockno on, to or
+// from data, bypassing the cache, in one disk request.
+// n is at most MAXSEG, and data must be in the kernel's
+// direct map of RAM, such as a page from kalloc().
+void
+brwn(uint dev, uint blockno, char *data, int n, int write)
+{
+  virtio_disk_rwmem(blockno, data, n, write);
+}
+
+// Read or write block blockno of dev, to or from data,
+// bypassing the cache.
+void
+brw(uint dev, uint blockno, char *data, int write)
+{
+  struct buf *b = &braw.buf;
+
+  acquiresleep(&braw.lock);
+  b->dev = dev;
+  b->blockno = blockno;
+  if(write)
+    memmove(b->data, data, BSIZE);
+  virtio_disk_rw(b, write);
+  if(!write)
+    memmove(data, b->data, BSIZE);
+  releasesleep(&braw.lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +729,106 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the n locked bufs b[0..n-1] to disk, b[i] to block
+// blockno[i], or to its own block if blockno is 0. the disk
+// gets them all at once, runs of consecutive blocks in
+// multi-block requests, so this takes little longer than
+// one bwrite().
+void
+bwritev(struct buf **b, uint *blockno, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+  virtio_disk_writev(b, blockno, n);
+}
+
+// the bucket b is in. its block can't change while
+// the caller holds a reference.
+static struct bucket*
+bbucket(struct buf *b)
+{
+  return &bcache.bucket[HASH(b->dev, b->blockno)];
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else is using it, it goes on a free list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk = bbucket(b);
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  acquire(&bk->lock);
+  bdrop(b);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);
+  struct bucket *bk = bbucket(b);
+
+  acquire(&bk->lock);
+  bhold(b);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
+  struct bucket *bk = bbucket(b);
+
+  acquire(&bk->lock);
+  bdrop(b);
+  release(&bk->lock);
+}
+
+// fill in st with the cache's statistics.
+void
+bstat(struct bcstat *st)
+{
+  struct bpage *pg;
+  struct buf *b;
+
+  memset(st, 0, sizeof(*st));
+  for(int i = 0; i < ncpu; i++){
+    st->hits += bcache.stat[i].hits;
+    st->misses += bcache.stat[i].misses;
+    st->evictions += bcache.stat[i].evictions;
+    st->waits += bcache.stat[i].waits;
+    st->waitus += bcache.stat[i].waittime * 1000000 / timebase;
+  }
+
+  // racy looks at the buffers, but they're only statistics.
   acquire(&bcache.lock);
-  b->refcnt--;
+  for(pg = bcache.pages; pg; pg = pg->next){
+    for(b = pg->buf; b < &pg->buf[BPERPG]; b++){
+      st->nbuf++;
+      if(b->refcnt > 0){
+        st->nbusy++;
+        if(!b->lock.locked)
+          st->npinned++;
+      }
+    }
+  }
   release(&bcache.lock);
 }
 
+// print the cache's statistics, for ^P.
+void
+bstats(void)
+{
+  struct bcstat st;
+  uint64 all;
 
+  bstat(&st);
+  all = st.hits + st.misses;
+  printf("bcache: %d buffers, %d busy, %d pinned, %d hits, %d misses, "
+         "%d evictions, %d%% hit, %d waits, %dms waiting\n",
+         st.nbuf, st.nbusy, st.npinned, (int)st.hits, (int)st.misses,
+         (int)st.evictions, all ? (int)(st.hits * 100 / all) : 0,
+         (int)st.waits, (int)(st.waitus / 1000));
+}
@@ -1,12 +1,19 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // readahead: the disk holds a reference
+  int reading; // bread_async() started a read of it
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // bcache.clock when read in, to order cold ones
+  int hot;      // re-read after eviction, so kept in preference
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  int freelist; // which free list it's on, if refcnt is 0
+  struct buf *fprev; // free list
+  struct buf *fnext;
   uchar data[BSIZE];
 };
 
@@ -84,6 +84,8 @@ consoleread(int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  if(user_dst)
+    uvmprefault(myproc()->pagetable, dst, n);
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -140,6 +142,7 @@ consoleintr(int c)
   switch(c){
   case C('P'):  // Print process list.
     procdump();
+    bstats();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
@@ -1,21 +1,37 @@
+struct bcstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct shm;
 struct spinlock;
 struct sleeplock;
+struct spawnact;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
+void            bcacheinit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
+struct buf*     bclaim(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, uint*, int);
+int             bpeek(uint, uint, char*);
+void            brw(uint, uint, char*, int);
+void            brwn(uint, uint, char*, int, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+void            bstat(struct bcstat*);
+void            bstats(void);
 
 // console.c
 void            consoleinit(void);
@@ -23,7 +39,14 @@ void            consoleintr(int);
 void            consputc(int);
 
 // exec.c
-int             exec(char*, char**);
+int             exec(struct proc*, char*, char**);
+
+// fdt.c
+extern uint64   phystop;
+extern int      ncpu;
+extern int      rvv;
+extern uint64   timebase;
+void            fdtinit(uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -36,6 +59,7 @@ int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+uint            bmap(struct inode*, uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -46,6 +70,9 @@ void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            itext(struct inode*, int);
+int             itextbusy(struct inode*);
+void            itextput(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -60,7 +87,13 @@ void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
 // kalloc.c
+void*           bootalloc(uint64);
 void*           kalloc(void);
+void*           ktryalloc(void);
+void*           kdup(void *);
+int             krefcnt(void *);
+void*           superalloc(void);
+void            superfree(void *);
 void            kfree(void *);
 void            kinit(void);
 
@@ -68,8 +101,26 @@ void            kinit(void);
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
+int             logopmax(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint);
+uint64          mmapbase(struct proc*);
+int             mmapdup(struct proc*, struct proc*);
+uint64          mmapfault(struct proc*, struct vma*, uint64, int);
+int             munmap(struct proc*, uint64, uint64);
+void            munmapall(struct proc*);
+struct vma*     vmalookup(struct proc*, uint64);
+
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint);
+void            pcwrite(struct inode*, uint, char*, uint);
+void            pcdrop(struct inode*);
+int             pcreclaim(void);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -82,9 +133,11 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+void            cpuinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawnact*, int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -100,6 +153,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -107,17 +161,35 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapout(void);
+uint64          swapin(pagetable_t, uint64, pte_t*);
+void            swapdup(uint64);
+void            swapfree(uint64);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// start.c
+void            bootharts(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// shm.c
+void            shminit(void);
+struct shm*     shmget(char*, uint64);
+char*           shmpage(struct shm*, uint64);
+void            shmput(struct shm*);
+uint64          shmsize(struct shm*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -148,6 +220,10 @@ void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 
+// uaccess.S
+int             ucopy(void*, void*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -156,24 +232,43 @@ void            uartputc_sync(int);
 int             uartgetc(void);
 
 // vm.c
+extern uint64   asidmax;
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+pagetable_t     kvmcreate(void);
+void            kvmfree(pagetable_t);
+void            kvmsync(struct proc*);
+void            kvmswitch(struct proc*);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
+void*           ualloc(void);
+void            uvmcount(pagetable_t, int*, int*);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64);
+void            uvmflush(pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          pteaddr(pte_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// vstring.S
+void            vmemset(void*, int, uint64);
+void            vmemcpy(void*, const void*, uint64);
+int             vmemcmp(const void*, const void*, uint64);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -183,6 +278,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_writev(struct buf **, uint *, int);
+void            virtio_disk_rwmem(uint, char *, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -7,8 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -19,17 +17,25 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Replace p's image with the program in path. p is the current
+// process, or one that spawn() is building and hasn't started.
+// Loadable segments aren't read here: exec() records where each
+// lives in the file, and vmfault() reads a page from the inode
+// the first time the program touches it, so starting a big
+// program costs only the pages it actually uses. read-only
+// pages come from the page cache, shared by every process
+// running the program.
 int
-exec(char *path, char **argv)
+exec(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *oldip;
   struct proghdr ph;
+  struct seg segs[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -49,7 +55,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each segment lives in the file.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,18 +67,25 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad; // overlaps the previous segment
+    if(nseg >= NSEG)
       goto bad;
+    segs[nseg].va = ph.vaddr;
+    segs[nseg].memsz = ph.memsz;
+    segs[nseg].filesz = ph.filesz;
+    segs[nseg].off = ph.off;
+    segs[nseg].perm = flags2perm(ph.flags) | PTE_R | PTE_U;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+
+  // keep a reference to ip for vmfault(), and
+  // refuse writes to it while this program runs.
+  itext(ip, 1);
+  iunlock(ip);
   end_op();
-  ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -81,7 +94,7 @@ exec(char *path, char **argv)
   sz = PGROUNDUP(sz);
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
-    goto bad;
+    goto badtext;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
@@ -90,13 +103,13 @@ exec(char *path, char **argv)
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
-      goto bad;
+      goto badtext;
     sp -= strlen(argv[argc]) + 1;
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
-      goto bad;
+      goto badtext;
     if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+      goto badtext;
     ustack[argc] = sp;
   }
   ustack[argc] = 0;
@@ -105,9 +118,9 @@ exec(char *path, char **argv)
   sp -= (argc+1) * sizeof(uint64);
   sp -= sp % 16;
   if(sp < stackbase)
-    goto bad;
+    goto badtext;
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
-    goto bad;
+    goto badtext;
 
   // arguments to user main(argc, argv)
   // argc is returned via the system call return
@@ -121,12 +134,21 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
+  oldip = p->execip;
   p->pagetable = pagetable;
+  kvmsync(p);
   p->sz = sz;
+  p->superlo = p->superhi = 0;
+  p->execip = ip;
+  memset(p->segs, 0, sizeof(p->segs));
+  memmove(p->segs, segs, nseg * sizeof(segs[0]));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldip)
+    itextput(oldip);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -138,29 +160,9 @@ exec(char *path, char **argv)
     end_op();
   }
   return -1;
-}
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+ badtext:
+  proc_freepagetable(pagetable, sz);
+  itextput(ip);
+  return -1;
 }
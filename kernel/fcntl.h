@@ -3,3 +3,23 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_ANONYMOUS 0x20
+
+// spawn() file actions, applied in order to the child's
+// copy of the parent's open files.
+#define SPAWN_CLOSE   1   // close fd
+#define SPAWN_DUP2    2   // make newfd refer to fd's file
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
+};
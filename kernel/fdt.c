@@ -0,0 +1,180 @@
+//
+// flattened device tree (FDT) parsing.
+//
+// qemu passes the physical address of a device tree blob
+// in a1 when it starts each hart. main() calls fdtinit()
+// on hart 0, before kinit(), to learn how much RAM the
+// machine has and how many harts it started, instead of
+// assuming the -m 128M that the Makefile used to hard-wire,
+// and whether the harts have the vector extension.
+//
+// the blob is big-endian. the structure block is a
+// sequence of 32-bit tokens:
+//   FDT_BEGIN_NODE name...  (name is NUL-terminated, padded to 4)
+//   FDT_PROP len nameoff value...  (value padded to 4)
+//   FDT_END_NODE
+// with nodes nested, and FDT_END at the very end.
+// property names live in the separate strings block.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+struct fdt_header {
+  uint32 magic;
+  uint32 totalsize;
+  uint32 off_dt_struct;
+  uint32 off_dt_strings;
+  uint32 off_mem_rsvmap;
+  uint32 version;
+  uint32 last_comp_version;
+  uint32 boot_cpuid_phys;
+  uint32 size_dt_strings;
+  uint32 size_dt_struct;
+};
+
+// top of usable RAM, and number of harts, as found by fdtinit().
+uint64 phystop = KERNBASE + 128*1024*1024;
+int ncpu = 1;
+
+// do all the harts have the V extension? string.c uses
+// it, if the kernel was built with RVV.
+int rvv;
+
+// rate of the time CSR, in ticks per second.
+uint64 timebase = 10000000;
+
+static uint32
+be32(void *p)
+{
+  uchar *b = p;
+  return ((uint32)b[0] << 24) | ((uint32)b[1] << 16) |
+         ((uint32)b[2] << 8) | (uint32)b[3];
+}
+
+// read a value spread over cells 32-bit big-endian cells.
+static uint64
+becells(uint32 *p, int cells)
+{
+  uint64 v = 0;
+  for(int i = 0; i < cells; i++)
+    v = (v << 32) | be32(&p[i]);
+  return v;
+}
+
+// does node name begin with prefix, followed by '@' or NUL?
+static int
+nodeis(char *name, char *prefix)
+{
+  int n = strlen(prefix);
+  if(strncmp(name, prefix, n) != 0)
+    return 0;
+  return name[n] == '@' || name[n] == '\0';
+}
+
+// does a riscv,isa string like "rv64imafdcv_zicsr" include
+// the single-letter extension c?
+static int
+isahas(char *isa, int c)
+{
+  if(strncmp(isa, "rv64", 4) != 0)
+    return 0;
+  for(isa += 4; *isa && *isa != '_'; isa++)
+    if(*isa == c)
+      return 1;
+  return 0;
+}
+
+// Parse the device tree at pa, setting phystop, ncpu, rvv
+// and timebase.
+// Leaves the defaults alone if there is no valid tree.
+void
+fdtinit(uint64 pa)
+{
+  struct fdt_header *h = (struct fdt_header *)pa;
+  uint32 *tok, *end;
+  char *strings, *name;
+  char *path[4];        // node names from the root down to depth
+  int depth = 0;
+  int acells = 2, scells = 1; // root's #address-cells, #size-cells
+  int harts = 0, vharts = 0;
+  uint64 top = 0;
+
+  if(pa == 0 || be32(&h->magic) != FDT_MAGIC){
+    printf("fdt: no device tree, assuming %dMB\n",
+           (int)((phystop - KERNBASE) >> 20));
+    return;
+  }
+
+  tok = (uint32 *)(pa + be32(&h->off_dt_struct));
+  end = (uint32 *)((char *)tok + be32(&h->size_dt_struct));
+  strings = (char *)(pa + be32(&h->off_dt_strings));
+
+  while(tok < end){
+    uint32 t = be32(tok++);
+    if(t == FDT_BEGIN_NODE){
+      name = (char *)tok;
+      tok += (strlen(name) + 4) / 4;
+      if(depth < NELEM(path))
+        path[depth] = name;
+      depth++;
+      // a cpu node directly under /cpus is one hart.
+      if(depth == 3 && nodeis(path[1], "cpus") && nodeis(name, "cpu"))
+        harts++;
+    } else if(t == FDT_END_NODE){
+      depth--;
+    } else if(t == FDT_PROP){
+      uint32 len = be32(tok++);
+      char *pname = strings + be32(tok++);
+      uint32 *val = tok;
+      tok += (len + 3) / 4;
+
+      if(depth == 1 && strncmp(pname, "#address-cells", 15) == 0)
+        acells = be32(val);
+      else if(depth == 1 && strncmp(pname, "#size-cells", 12) == 0)
+        scells = be32(val);
+      else if(depth == 2 && nodeis(path[1], "memory") &&
+              strncmp(pname, "reg", 4) == 0){
+        // (base, size) pairs; use the bank that holds the kernel.
+        for(int i = 0; i + acells + scells <= len / 4; i += acells + scells){
+          uint64 base = becells(val + i, acells);
+          uint64 size = becells(val + i + acells, scells);
+          if(base <= KERNBASE && base + size > KERNBASE && base + size > top)
+            top = base + size;
+        }
+      } else if(depth == 2 && nodeis(path[1], "cpus") &&
+                strncmp(pname, "timebase-frequency", 19) == 0){
+        if(be32(val) > 0)
+          timebase = be32(val);
+      } else if(depth == 3 && nodeis(path[1], "cpus") && nodeis(path[2], "cpu") &&
+                strncmp(pname, "riscv,isa", 10) == 0){
+        if(isahas((char *)val, 'v'))
+          vharts++;
+      }
+    } else if(t == FDT_NOP){
+      continue;
+    } else {
+      break; // FDT_END, or garbage
+    }
+  }
+
+  if(top > KERNBASE)
+    phystop = PGROUNDDOWN(top);
+  if(harts > NCPU)
+    harts = NCPU;
+  if(harts > 0)
+    ncpu = harts;
+  rvv = harts > 0 && vharts >= harts;
+  printf("fdt: %dMB of RAM, %d harts%s\n",
+         (int)((phystop - KERNBASE) >> 20), ncpu, rvv ? ", vector" : "");
+}
@@ -79,6 +79,8 @@ fileclose(struct file *f)
     begin_op();
     iput(ff.ip);
     end_op();
+  } else if(ff.type == FD_SHM){
+    shmput(ff.shm);
   }
 }
 
@@ -118,10 +120,14 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // paging in addr might need f->ip's lock.
+    uvmprefault(myproc()->pagetable, addr, n);
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
+  } else if(f->type == FD_SHM){
+    return -1; // map it instead
   } else {
     panic("fileread");
   }
@@ -146,20 +152,23 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    // write as many blocks at a time as one FS call may
+    // reserve log space for, less the i-node, indirect
+    // block, 2 allocation blocks, and a block of slop
+    // for a non-aligned write. each piece reserves just
+    // what it needs. this really belongs lower down,
+    // since writei() might be writing a device like the
+    // console.
+    int max = (logopmax()-1-1-1-2) * BSIZE;
     int i = 0;
+    // paging in addr might need f->ip's lock.
+    uvmprefault(myproc()->pagetable, addr, n);
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn((n1 + BSIZE - 1) / BSIZE + 1+1+1+2);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -173,6 +182,8 @@ filewrite(struct file *f, uint64 addr, int n)
       i += r;
     }
     ret = (i == n ? n : -1);
+  } else if(f->type == FD_SHM){
+    return -1; // map it instead
   } else {
     panic("filewrite");
   }
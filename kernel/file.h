@@ -1,5 +1,5 @@
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_SHM } type;
   int ref; // reference count
   char readable;
   char writable;
@@ -7,17 +7,30 @@ struct file {
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
+  struct shm *shm;   // FD_SHM
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+// an inode's cached data pages, in a radix tree keyed
+// by page index in the file; see pcache.c.
+struct pctree {
+  void **root;        // 0 if nothing is cached
+  int height;
+};
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int text;           // Running programs paging from it; protected by itable.lock
+  struct pctree pc;   // Cached data; protected by pcache.lock
+  uint ranext;        // page pcget() expects next if reads are sequential
+  uint raend;         // pages before this have been read ahead
+  int nmap;           // MAP_SHARED mappings; pcreclaim() leaves its pages be
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -44,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -250,15 +251,18 @@ iget(uint dev, uint inum)
 
   acquire(&itable.lock);
 
-  // Is the inode already in the table?
+  // Is the inode already in the table? an unused entry
+  // that still has cached pages is as good as a used one,
+  // since iput() keeps its copy of the inode up to date.
   empty = 0;
   for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+    if(ip->dev == dev && ip->inum == inum && (ip->ref > 0 || ip->pc.root)){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
+    // Remember an empty slot, preferably one with no cached pages.
+    if(ip->ref == 0 && (empty == 0 || (empty->pc.root && ip->pc.root == 0)))
       empty = ip;
   }
 
@@ -267,9 +271,12 @@ iget(uint dev, uint inum)
     panic("iget: no inodes");
 
   ip = empty;
+  pcdrop(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
+  ip->ranext = 0;
+  ip->raend = 0;
   ip->valid = 0;
   release(&itable.lock);
 
@@ -361,6 +368,41 @@ iput(struct inode *ip)
   release(&itable.lock);
 }
 
+// Adjust the count of running programs paged in from ip.
+// While it is non-zero writei() refuses to change ip, so
+// vmfault() can read it without holding ip->lock.
+void
+itext(struct inode *ip, int n)
+{
+  acquire(&itable.lock);
+  ip->text += n;
+  if(ip->text < 0)
+    panic("itext");
+  release(&itable.lock);
+}
+
+// Drop a running program's reference to its executable.
+void
+itextput(struct inode *ip)
+{
+  begin_op();
+  itext(ip, -1);
+  iput(ip);
+  end_op();
+}
+
+// Is ip the executable of a running program?
+int
+itextbusy(struct inode *ip)
+{
+  int busy;
+
+  acquire(&itable.lock);
+  busy = ip->text > 0;
+  release(&itable.lock);
+  return busy;
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -379,7 +421,7 @@ iunlockput(struct inode *ip)
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 // returns 0 if out of disk space.
-static uint
+uint
 bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
@@ -429,6 +471,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcdrop(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -464,15 +508,17 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
+// Read data from inode, through the page cache.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
+  char *pg;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -480,17 +526,27 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    // paging in dst might need this very page.
+    if(user_dst)
+      uvmprefault(myproc()->pagetable, dst, m);
+    if((pg = pcget(ip, off/PGSIZE)) != 0){
+      r = either_copyout(user_dst, dst, pg + (off % PGSIZE), m);
+      kfree(pg);
+    } else {
+      // no memory to cache it in: read a block through
+      // the buffer cache.
+      if((addr = bmap(ip, off/BSIZE)) == 0)
+        break;
+      m = min(n - tot, BSIZE - off%BSIZE);
+      bp = bread(ip->dev, addr);
+      r = either_copyout(user_dst, dst, bp->data + (off % BSIZE), m);
       brelse(bp);
+    }
+    if(r == -1){
       tot = -1;
       break;
     }
-    brelse(bp);
   }
   return tot;
 }
@@ -512,6 +568,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(itextbusy(ip))
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -523,6 +581,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcwrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -1,6 +1,21 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and 2MB megapages for large user heaps.
+//
+// Free memory starts out as megapages, on their own list;
+// kalloc() breaks one up when the 4096-byte lists run dry.
+// Freed 4096-byte pages are never put back together, but
+// a megapage that is unmapped whole goes back intact.
+//
+// Memory that's free is used to cache file data (pcache.c);
+// kalloc() takes it back when there's nothing else left,
+// and then shrinks the buffer cache (bio.c).
+//
+// Each page has a reference count, so that copy-on-write
+// fork can share a page between page tables. kalloc()
+// returns a page with one reference, kdup() adds one, and
+// kfree() drops one, freeing the page when none remain.
 
 #include "types.h"
 #include "param.h"
@@ -18,48 +33,235 @@ struct run {
   struct run *next;
 };
 
+// one free list per CPU, so that harts don't all
+// contend for a single lock. kalloc() steals from
+// another CPU's list when its own runs dry.
+struct kmem {
+  struct spinlock lock;
+  struct run *freelist;
+};
+struct kmem *kmems; // ncpu of them
+
+#define NSTEAL 32 // pages to take from another CPU at once
+
+// free megapages.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+} kbig;
+
+// reference counts, one per page from KERNBASE to PHYSTOP.
+// updated with atomic instructions rather than under a lock.
+static int *krefs;
+#define KREF(pa) krefs[((uint64)(pa) - KERNBASE) / PGSIZE]
+
+// bootalloc() hands out memory from here up
+// until kinit() gives the rest to kfree().
+static char *bootnext = end;
+static int bootdone;
+
+// Allocate n zeroed bytes that are never freed, for
+// structures sized by what fdtinit() discovered.
+// Only usable before kinit().
+void *
+bootalloc(uint64 n)
+{
+  char *p;
+
+  if(bootdone)
+    panic("bootalloc");
+  p = (char*)(((uint64)bootnext + 63) & ~63L);
+  if(p + n > (char*)PHYSTOP)
+    panic("bootalloc: out of memory");
+  bootnext = p + n;
+  memset(p, 0, n);
+  return p;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  kmems = bootalloc(ncpu * sizeof(struct kmem));
+  for(int i = 0; i < ncpu; i++)
+    initlock(&kmems[i].lock, "kmem");
+  initlock(&kbig.lock, "kbig");
+  krefs = bootalloc((PHYSTOP - KERNBASE) / PGSIZE * sizeof(int));
+  bootdone = 1;
+  freerange(bootnext, (void*)PHYSTOP);
 }
 
+// free [pa_start, pa_end): aligned megapages as
+// megapages, the ragged ends page by page.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    if((uint64)p % SUPERPGSIZE == 0 && p + SUPERPGSIZE <= (char*)pa_end){
+      for(int i = 0; i < 512; i++)
+        KREF(p + i*PGSIZE) = 1;
+      superfree(p);
+      p += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    KREF(p) = 1;
     kfree(p);
+  }
+}
+
+// Add a reference to the page at pa, which must
+// have come from kalloc(). Returns pa, to
+// enable the pa = kdup(pa1) idiom.
+void *
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < bootnext || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&KREF(pa), 1) < 1)
+    panic("kdup: free page");
+  return pa;
+}
+
+// How many references does the page at pa have?
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&KREF(pa), __ATOMIC_SEQ_CST);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// Frees the page if that was the last reference.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int ref;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < bootnext || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&KREF(pa), 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: free page");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmems[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  release(&km->lock);
+  pop_off();
+}
+
+// Take up to NSTEAL pages from some other CPU's free list,
+// keep one for the caller, and put the rest on CPU id's list.
+// Holds only one kmem lock at a time.
+static struct run *
+ksteal(int id)
+{
+  struct run *r, *last;
+  int i, n;
+
+  for(i = 1; i < ncpu; i++){
+    struct kmem *km = &kmems[(id + i) % ncpu];
+    acquire(&km->lock);
+    r = km->freelist;
+    if(r == 0){
+      release(&km->lock);
+      continue;
+    }
+    last = r;
+    for(n = 1; n < NSTEAL && last->next; n++)
+      last = last->next;
+    km->freelist = last->next;
+    release(&km->lock);
+
+    last->next = 0;
+    if(r->next){
+      km = &kmems[id];
+      acquire(&km->lock);
+      last->next = km->freelist;
+      km->freelist = r->next;
+      release(&km->lock);
+    }
+    return r;
+  }
+  return 0;
+}
+
+// Break up a free megapage: keep its first page for the
+// caller, and put the rest on CPU id's list.
+static struct run *
+ksplit(int id)
+{
+  struct run *r, *q;
+  struct kmem *km = &kmems[id];
+  char *pa;
+
+  acquire(&kbig.lock);
+  r = kbig.freelist;
+  if(r)
+    kbig.freelist = r->next;
+  release(&kbig.lock);
+  if(r == 0)
+    return 0;
+
+  pa = (char*)r;
+  acquire(&km->lock);
+  for(int i = 511; i > 0; i--){
+    q = (struct run*)(pa + i*PGSIZE);
+    q->next = km->freelist;
+    km->freelist = q;
+  }
+  release(&km->lock);
+  return r;
+}
+
+// take a free page, reclaiming cached memory for it
+// if reclaim is set and there is none.
+static void *
+kalloc1(int reclaim)
+{
+  struct run *r;
+  struct kmem *km;
+  int id;
+
+ again:
+  push_off();
+  id = cpuid();
+  km = &kmems[id];
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r)
+    km->freelist = r->next;
+  release(&km->lock);
+  if(r == 0)
+    r = ksteal(id);
+  if(r == 0)
+    r = ksplit(id);
+  pop_off();
+
+  // free memory may be full of cached file data, and
+  // the buffer cache may be bigger than it needs to be.
+  if(r == 0 && reclaim && (pcreclaim() || bshrink()))
+    goto again;
+
+  if(r){
+    KREF(r) = 1;
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +269,57 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  return kalloc1(1);
+}
+
+// Allocate a page only if one is free, without giving back
+// cached memory for it. for the caches themselves to grow.
+void *
+ktryalloc(void)
+{
+  return kalloc1(0);
+}
+
+// Allocate a 2MB-aligned megapage, with one reference on
+// each of its 4096-byte pages, so that it can later be
+// unmapped a page at a time. The contents are garbage.
+// Returns 0 if there are no free megapages.
+void *
+superalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  acquire(&kbig.lock);
+  r = kbig.freelist;
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    kbig.freelist = r->next;
+  release(&kbig.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    for(int i = 0; i < 512; i++)
+      KREF((char*)r + i*PGSIZE) = 1;
+  }
   return (void*)r;
 }
+
+// Free a megapage from superalloc() whose pages each
+// still have exactly one reference.
+void
+superfree(void *pa)
+{
+  struct run *r;
+
+  if(((uint64)pa % SUPERPGSIZE) != 0 || (char*)pa < bootnext || (uint64)pa >= PHYSTOP)
+    panic("superfree");
+  for(int i = 0; i < 512; i++){
+    if(__sync_sub_and_fetch(&KREF((char*)pa + i*PGSIZE), 1) != 0)
+      panic("superfree: shared");
+  }
+
+  r = (struct run*)pa;
+  acquire(&kbig.lock);
+  r->next = kbig.freelist;
+  kbig.freelist = r;
+  release(&kbig.lock);
+}
@@ -6,143 +6,418 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only commits a transaction when
+// none of its FS system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves log
+// space for MAXOPBLOCKS blocks and returns; begin_opn()
+// reserves space for more, for a big write. But if the log
+// is close to running out, it sleeps until the last
+// outstanding end_op() commits, or checkpoints to make room.
+// mkfs decides how big the log is.
 //
-// The log is a physical re-do log containing disk blocks.
+// There are two transactions at a time: the running one,
+// which FS system calls join, and the one being committed.
+// The last end_op() of the running transaction closes it,
+// copies its blocks into log buffers, which is quick, and
+// then writes them out while new system calls join the next
+// transaction. If a commit is already under way, the running
+// transaction goes on taking system calls, and the commit
+// takes it next, so transactions group more calls together
+// the busier the disk is. A transaction that has run for
+// LOGCOMMIT ticks takes no more system calls, so that it
+// commits even if they keep coming.
+//
+// The log is a physical re-do log containing disk blocks,
+// used as a circular buffer of log.nslot slots.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
+//   header block, containing the number of the first
+//     entry that isn't installed yet
+//   slot 0
+//   slot 1
 //   ...
-// Log appends are synchronous.
+// Each transaction is a commit record followed by its
+// blocks. The record lists the blocks' home locations and
+// holds a checksum of them, so recovery can tell whether all
+// of the transaction reached the disk, whatever order the
+// disk wrote them in. Committing writes the record and the
+// blocks to the slots after the ones in use, and that is
+// all end_op() waits for. The blocks stay pinned in the
+// buffer cache until the flusher kernel thread checkpoints
+// them: writes them to their home locations from the log,
+// and then the header, once for all of the transactions it
+// installed, to free their slots. It does that once the
+// oldest has been committed for LOGAGE ticks, or committed
+// blocks fill LOGDIRTY percent of the log, or when
+// begin_op() finds the log full. Checkpoints run alongside
+// FS system calls and commits, since they write only what
+// is already committed.
+//
+// Log entries are numbered, across reboots too; entry i is
+// in slot i % log.nslot, and a commit record holds its own
+// number, so recovery can tell it from an old record left in
+// the same slot. A block may be in the log more than once,
+// if several transactions wrote it; recovery installs them
+// in order, so the newest wins.
+
+#define LOGMAGIC 0x10c0ffee
+
+// home blocks a checkpoint writes at once.
+#define NINSTALL 16
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Contents of the header block.
 struct logheader {
-  int n;
-  int block[LOGSIZE];
+  uint start;  // first entry not yet installed
+};
+
+// A commit record, in the slot before its transaction's blocks.
+struct logcommit {
+  uint sum;    // checksum of the blocks, then the rest of this
+  uint magic;
+  uint seq;    // this record's entry number
+  uint n;      // number of blocks after it
+  int block[LOGSIZE-1];  // their home blocks
+};
+
+// A Fletcher-style checksum, over 32-bit words.
+struct cksum {
+  uint64 a, b;
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nslot;       // data blocks the log holds
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they have reserved
+  int locked;      // running transaction is closing, please wait.
+  int committing;  // in commit()
+  int checkpointing; // in checkpoint()
   int dev;
-  struct logheader lh;
+  // entries before installed are home, those before tail
+  // are free on disk too, those before durable are
+  // committed on disk, those before frozen are copied to
+  // log buffers, and [frozen, head) are the running
+  // transaction's.
+  uint tail;
+  uint installed;
+  uint durable;
+  uint frozen;
+  uint head;
+  uint dirtysince; // ticks when entry installed was committed
+  uint txnstart;   // ticks when the running transaction began
+  int block[LOGSIZE]; // home block of each slot; 0 for a commit record
+  struct buf *wbuf[LOGSIZE]; // write_log()'s; only the committer uses it
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logcommit) > BSIZE)
+    panic("initlog: too big logcommit");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.nslot = log.size - 1;
+  if(log.nslot > LOGSIZE || log.nslot < 2*MAXOPBLOCKS)
+    panic("initlog: bad log size");
   log.dev = dev;
   recover_from_log();
+  kthread("flusher", flusher);
 }
 
-// Copy committed blocks from log to their home location
 static void
-install_trans(int recovering)
+cksum(struct cksum *c, void *data, int n)
 {
-  int tail;
+  uint *w = data;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for(int i = 0; i < n / 4; i++){
+    c->a += w[i];
+    c->b += c->a;
   }
 }
 
-// Read the log header from disk into the in-memory log header
+static uint
+cksumval(struct cksum *c)
+{
+  return c->a ^ c->b ^ (c->b >> 32);
+}
+
+// Write the n log buffers in lbuf to their home blocks in
+// home, all at once, then unpin the home blocks' buffers.
 static void
+install_batch(struct buf **lbuf, uint *home, struct buf **dbuf, int n)
+{
+  bwritev(lbuf, home, n);
+  for (int k = 0; k < n; k++) {
+    brelse(lbuf[k]);
+    bunpin(dbuf[k]);
+  }
+}
+
+// Copy log entries [from, to) to their home locations,
+// skipping commit records and blocks that a later entry
+// supersedes. Unless recovering, unpin their buffers.
+static void
+install_trans(uint from, uint to, int recovering)
+{
+  struct buf *lbufs[NINSTALL], *dbufs[NINSTALL];
+  uint homes[NINSTALL];
+  uint i, j;
+  int home, n = 0;
+
+  for (i = from; i < to; i++) {
+    home = log.block[i % log.nslot];
+    if (home == 0)
+      continue;
+    for (j = i+1; j < to; j++)
+      if (log.block[j % log.nslot] == home)
+        break;
+    struct buf *dbuf = bread(log.dev, home); // read dst
+    if (j < to) {
+      // a later entry keeps it pinned.
+      if(recovering == 0)
+        bunpin(dbuf);
+      brelse(dbuf);
+      continue;
+    }
+    struct buf *lbuf = bread(log.dev, log.start+1+i%log.nslot); // read log block
+    if (recovering) {
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+      continue;
+    }
+    // dbuf may hold a newer, uncommitted version by now, so
+    // write the log's copy, and keep dbuf pinned until it's
+    // on the disk, lest it be read back from there.
+    brelse(dbuf);
+    lbufs[n] = lbuf;
+    homes[n] = home;
+    dbufs[n] = dbuf;
+    if (++n == NINSTALL) {
+      install_batch(lbufs, homes, dbufs, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    install_batch(lbufs, homes, dbufs, n);
+}
+
+// Read the log header from disk; return the first entry
+// that isn't installed.
+static uint
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  uint start;
+
+  start = lh->start;
   brelse(buf);
+  return start;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the in-memory log header to disk, to say that the
+// entries before log.installed are home, so that their
+// slots may be reused.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  uint installed;
+
+  // holding buf's lock keeps writes of the header in order.
+  acquire(&log.lock);
+  installed = log.installed;
+  release(&log.lock);
+  hb->start = installed;
   bwrite(buf);
+  acquire(&log.lock);
+  log.tail = installed;
+  wakeup(&log);
+  release(&log.lock);
   brelse(buf);
 }
 
+// Is there a whole transaction at entry seq, which may use
+// up to max entries? If so, fill in log.block for it and
+// return its size in entries, including the record.
+static int
+valid_trans(uint seq, uint max)
+{
+  struct buf *cbuf = bread(log.dev, log.start+1+seq%log.nslot);
+  struct logcommit *lc = (struct logcommit *) (cbuf->data);
+  struct cksum c = {0, 0};
+  uint i;
+  int n = -1;
+
+  if (lc->magic == LOGMAGIC && lc->seq == seq && lc->n < max) {
+    for (i = 1; i <= lc->n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+1+(seq+i)%log.nslot);
+      cksum(&c, lbuf->data, BSIZE);
+      brelse(lbuf);
+    }
+    cksum(&c, &lc->magic, BSIZE - sizeof(lc->sum));
+    if (cksumval(&c) == lc->sum) {
+      log.block[seq % log.nslot] = 0;
+      for (i = 1; i <= lc->n; i++)
+        log.block[(seq+i) % log.nslot] = lc->block[i-1];
+      n = lc->n + 1;
+    }
+  }
+  brelse(cbuf);
+  return n;
+}
+
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  uint start, end;
+  int n;
+
+  // find the transactions that were committed whole.
+  start = end = read_head();
+  while ((n = valid_trans(end, log.nslot - (end - start))) > 0)
+    end += n;
+  install_trans(start, end, 1); // copy them from log to disk
+  log.installed = log.durable = log.frozen = log.head = end;
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// write the committed blocks in the log to their home
+// locations, and free their log space. the caller must
+// have set log.checkpointing.
+static void
+checkpoint(void)
+{
+  uint from, to;
+
+  acquire(&log.lock);
+  from = log.installed;
+  to = log.durable;
+  release(&log.lock);
+
+  install_trans(from, to, 0);
+
+  acquire(&log.lock);
+  log.installed = to;
+  log.dirtysince = ticks;
+  release(&log.lock);
+  write_head();
+
+  acquire(&log.lock);
+  log.checkpointing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// the flusher kernel thread, which checkpoints
+// committed transactions once they are LOGAGE ticks
+// old or fill LOGDIRTY percent of the log.
+static void
+flusher(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(log.durable == log.installed){
+      // nothing to do until a commit.
+      sleep(&log.durable, &log.lock);
+      continue;
+    }
+    if(!log.checkpointing &&
+       (ticks - log.dirtysince >= LOGAGE ||
+        (log.durable - log.installed) * 100 >= log.nslot * LOGDIRTY)){
+      log.checkpointing = 1;
+      release(&log.lock);
+      checkpoint();
+      acquire(&log.lock);
+      continue;
+    }
+    // look again next tick.
+    release(&log.lock);
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+    acquire(&log.lock);
+  }
+}
+
+// the most log blocks one FS system call may reserve.
+int
+logopmax(void)
+{
+  return log.nslot / 2;
+}
+
+// called at the start of an FS system call that writes up
+// to n blocks, to reserve log space for them, and for the
+// commit record of the transaction it may start.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > logopmax())
+    panic("begin_opn");
+  n++;
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.locked){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.head - log.tail + log.reserved + n > log.nslot){
+      // this op might exhaust log space; make room, or
+      // wait for commit or checkpoint.
+      if(!log.checkpointing && log.durable != log.installed){
+        log.checkpointing = 1;
+        release(&log.lock);
+        checkpoint();
+        acquire(&log.lock);
+      } else {
+        if(log.head != log.frozen)
+          log.locked = 1; // commit what's there, to checkpoint it
+        sleep(&log, &log.lock);
+      }
+    } else if(log.head != log.frozen && ticks - log.txnstart >= LOGCOMMIT){
+      // the running transaction has gone on long enough.
+      log.locked = 1;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is under way, which will take this
+// transaction next.
 void
 end_op(void)
 {
@@ -150,15 +425,13 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= myproc()->logres;
+  if(log.outstanding == 0 && !log.committing && log.head != log.frozen){
     do_commit = 1;
     log.committing = 1;
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and this op's reservation is free now.
     wakeup(&log);
   }
   release(&log.lock);
@@ -167,44 +440,103 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the running transaction's blocks from cache to log
+// buffers, and make its commit record, all pinned until
+// write_log() writes them. No FS system calls are active,
+// and log.locked keeps new ones out, so the blocks hold
+// just what the transaction wrote.
+static void
+freeze(uint from, uint to)
+{
+  struct buf *cbuf = bclaim(log.dev, log.start+1+from%log.nslot);
+  struct logcommit *lc = (struct logcommit *) (cbuf->data);
+  struct cksum c = {0, 0};
+  uint i;
+
+  memset(lc, 0, BSIZE);
+  lc->magic = LOGMAGIC;
+  lc->seq = from;
+  lc->n = to - from - 1;
+  for (i = from+1; i < to; i++) {
+    struct buf *lbuf = bclaim(log.dev, log.start+1+i%log.nslot); // log block
+    struct buf *dbuf = bread(log.dev, log.block[i % log.nslot]); // cache block
+    memmove(lbuf->data, dbuf->data, BSIZE);
+    cksum(&c, lbuf->data, BSIZE);
+    lc->block[i-from-1] = log.block[i % log.nslot];
+    bpin(lbuf);
+    brelse(dbuf);
+    brelse(lbuf);
+  }
+  cksum(&c, &lc->magic, BSIZE - sizeof(lc->sum));
+  lc->sum = cksumval(&c);
+  bpin(cbuf);
+  brelse(cbuf);
+}
+
+// Write the frozen log buffers to the log, all at once,
+// in a few multi-block requests for the sequential log area.
 static void
-write_log(void)
+write_log(uint from, uint to)
 {
-  int tail;
+  uint i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (i = from; i < to; i++)
+    log.wbuf[i-from] = bread(log.dev, log.start+1+i%log.nslot); // log block
+  bwritev(log.wbuf, 0, to - from);  // write the log
+  for (i = from; i < to; i++) {
+    bunpin(log.wbuf[i-from]);
+    brelse(log.wbuf[i-from]);
   }
 }
 
+// commit the running transaction, which has no outstanding
+// FS system calls, and then the next if it is ready too.
+// the caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  uint from, to;
+
+  acquire(&log.lock);
+  while(log.outstanding == 0 && log.head != log.frozen){
+    // close the running transaction; begin_op() waits.
+    log.locked = 1;
+    from = log.frozen;
+    to = log.head;
+    release(&log.lock);
+    freeze(from, to);
+
+    // new FS system calls may start the next transaction.
+    acquire(&log.lock);
+    log.frozen = to;
+    log.locked = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    // Write the record and blocks to the log -- the real
+    // commit, once they are all on the disk.
+    write_log(from, to);
+    acquire(&log.lock);
+    if(log.durable == log.installed)
+      log.dirtysince = ticks;
+    log.durable = to;
+    wakeup(&log);
+    wakeup(&log.durable); // for the flusher
+    if(log.head != log.frozen && ticks - log.txnstart >= LOGCOMMIT)
+      log.locked = 1;  // the next one is overdue
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit()/write_log() will do the disk write, and
+// checkpoint() will unpin it.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,23 +546,28 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  uint i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  if (log.head == log.frozen) {
+    // a new transaction: its commit record comes first.
+    log.block[log.head % log.nslot] = 0;
+    log.head++;
+    log.txnstart = ticks;
+  }
+  for (i = log.frozen + 1; i < log.head; i++) {
+    if (log.block[i % log.nslot] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (i == log.head) {  // Add new block to log?
+    if (log.head - log.tail >= log.nslot)
+      panic("too big a transaction");
+    log.block[i % log.nslot] = b->blockno;
     bpin(b);
-    log.lh.n++;
+    log.head++;
   }
   release(&log.lock);
 }
-
@@ -6,6 +6,8 @@
 
 volatile static int started = 0;
 
+extern uint64 dtb; // start.c
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
@@ -16,6 +18,10 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    fdtinit(dtb);    // find RAM size and harts
+    cpuinit();       // per-CPU state, sized by hart count
+    bootharts();     // stacks for the other harts
+    bcacheinit();    // buffer cache tables, sized by RAM and harts
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
@@ -24,9 +30,11 @@ main()
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
-    binit();         // buffer cache
+    pcinit();        // page cache
+    binit();         // buffer cache, sized by RAM
     iinit();         // inode table
     fileinit();      // file table
+    shminit();       // shared-memory objects
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -11,6 +11,8 @@
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
+// qemu also passes the address of a device tree
+// blob in a1, describing RAM size and harts.
 
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
@@ -44,8 +46,9 @@
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
+// PHYSTOP is read from the device tree at boot (fdt.c).
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
+#define PHYSTOP phystop
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -65,3 +68,8 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the kernel sees the current process's user memory here,
+// in the upper half of its per-process page table, so that
+// user address va is at USERALIAS+va. see kvmcreate().
+#define USERALIAS 0xFFFFFFC000000000L
@@ -0,0 +1,372 @@
+//
+// memory-mapped files and anonymous memory.
+//
+// each process has a small table of mappings (p->vmas).
+// mmap() only records a mapping; vmfault() calls mmapfault()
+// to fill in a page the first time it is touched, reading it
+// from the file if the mapping has one.
+//
+// mappings are placed top-down below the trapframe, above
+// the heap. fork() gives children the pages that are mapped
+// already, MAP_SHARED ones shared and MAP_PRIVATE ones
+// copy-on-write; the rest are filled in by whichever process
+// touches them first. so that MAP_SHARED pages are shared
+// however they're filled in, MAP_SHARED file mappings map
+// the page cache's own pages, and the page cache keeps the
+// pages of a file with such mappings (ip->nmap). modified
+// pages are written back to the file by munmap() and exit().
+// to notice modifications, shared file pages are first
+// mapped read-only, and mmapfault() sets PTE_W and PTE_D on
+// the first write. MAP_PRIVATE file mappings get copies.
+// mappings of shared-memory objects (shm.c) map the
+// object's own pages, so they are shared by everyone;
+// anonymous MAP_SHARED mappings get an unnamed object.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// a MAP_SHARED file mapping has come (n = 1) or gone (-1).
+static void
+vmanmap(struct vma *v, int n)
+{
+  if(v->f && v->f->type == FD_INODE && (v->flags & MAP_SHARED))
+    __sync_fetch_and_add(&v->f->ip->nmap, n);
+}
+
+// the mapping containing va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// does [a, a+len) overlap any of p's mappings?
+static int
+vmaoverlap(struct proc *p, uint64 a, uint64 len)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len && a < v->addr + v->len && v->addr < a + len)
+      return 1;
+  return 0;
+}
+
+// lowest address used by a mapping; the heap may grow up to here.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// find the highest free range of len bytes that ends at the
+// trapframe or at the start of an existing mapping.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  uint64 a, best = 0;
+
+  for(int i = 0; i <= NVMA; i++){
+    if(i == NVMA)
+      a = TRAPFRAME;
+    else if(p->vmas[i].len)
+      a = p->vmas[i].addr;
+    else
+      continue;
+    if(a < len || a - len < PGROUNDUP(p->sz))
+      continue;
+    a -= len;
+    if(a > best && !vmaoverlap(p, a, len))
+      best = a;
+  }
+  return best;
+}
+
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len == 0)
+      return v;
+  return 0;
+}
+
+// map len bytes of f starting at off (or anonymous memory
+// if f is 0) into the current process.
+// returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct shm *s;
+  uint64 a;
+
+  len = PGROUNDUP(len);
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE)
+    return -1;
+  if((v = vmaalloc(p)) == 0 || (a = vmaplace(p, len)) == 0)
+    return -1;
+
+  // anonymous shared memory is an unnamed shm object, so
+  // a child that touches a page first still shares it.
+  if(f == 0 && (flags & MAP_SHARED)){
+    if((s = shmget(0, len)) == 0)
+      return -1;
+    if((f = filealloc()) == 0){
+      shmput(s);
+      return -1;
+    }
+    f->type = FD_SHM;
+    f->shm = s;
+    f->readable = 1;
+    f->writable = 1;
+    off = 0;
+    v->f = f;
+  } else {
+    v->f = f ? filedup(f) : 0;
+  }
+
+  v->addr = a;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  vmanmap(v, 1);
+  return a;
+}
+
+// write back the modified pages of a shared file mapping
+// in [a, a+len), which must be page-aligned.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 a, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  pte_t *pte;
+  uint off, n;
+
+  for(; a < v->addr + v->len && len > 0; a += PGSIZE, len -= PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    off = v->off + (a - v->addr);
+
+    // a page is at most four blocks plus the inode and an
+    // indirect block, so it fits one log transaction.
+    begin_op();
+    ilock(ip);
+    // don't extend the file with what lies past its end.
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// unmap [a, a+len) from p, writing back modified shared file
+// pages. a and len must be page-aligned. a mapping may lose
+// its start, its end, or a piece from the middle.
+// returns 0, or -1 with nothing changed if splitting a
+// mapping needs a free slot and there isn't one.
+int
+munmap(struct proc *p, uint64 a, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 start, end;
+
+  if(len == 0 || a % PGSIZE || len % PGSIZE || a + len < a)
+    return -1;
+
+  // only a range inside a single mapping punches a hole,
+  // so at most one split needs a slot; check for it first.
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->len && a > v->addr && a + len < v->addr + v->len && vmaalloc(p) == 0)
+      return -1;
+  }
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->len == 0 || a >= v->addr + v->len || v->addr >= a + len)
+      continue;
+    start = a > v->addr ? a : v->addr;
+    end = a + len < v->addr + v->len ? a + len : v->addr + v->len;
+
+    nv = 0;
+    if(start > v->addr && end < v->addr + v->len)
+      nv = vmaalloc(p);
+
+    if(v->f && v->f->type == FD_INODE && (v->flags & MAP_SHARED))
+      vmawriteback(p, v, start, end - start);
+    uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+
+    if(nv){
+      // punched a hole: nv gets the part above it.
+      *nv = *v;
+      nv->addr = end;
+      nv->len = v->addr + v->len - end;
+      nv->off = v->off + (end - v->addr);
+      filedup(nv->f);
+      vmanmap(nv, 1);
+      v->len = start - v->addr;
+    } else if(start == v->addr && end == v->addr + v->len){
+      vmanmap(v, -1);
+      if(v->f)
+        fileclose(v->f);
+      memset(v, 0, sizeof(*v));
+    } else if(start == v->addr){
+      v->off += end - v->addr;
+      v->len -= end - v->addr;
+      v->addr = end;
+    } else {
+      v->len = start - v->addr;
+    }
+  }
+  return 0;
+}
+
+// unmap all of p's mappings, for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len)
+      munmap(p, v->addr, v->len);
+}
+
+// give child np copies of p's mappings: MAP_SHARED pages
+// are shared, MAP_PRIVATE pages become copy-on-write.
+// pages not mapped yet are left for mmapfault().
+// returns 0, or -1 with nothing left mapped in np.
+int
+mmapdup(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vmas[i];
+    if(v->len == 0)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                (v->flags & MAP_SHARED) == 0) < 0)
+      goto err;
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vmas[i] = p->vmas[i];
+    if(np->vmas[i].f)
+      filedup(np->vmas[i].f);
+    if(np->vmas[i].len)
+      vmanmap(&np->vmas[i], 1);
+  }
+  return 0;
+
+ err:
+  while(--i >= 0)
+    if(p->vmas[i].len)
+      uvmunmap(np->pagetable, p->vmas[i].addr, p->vmas[i].len / PGSIZE, 1);
+  return -1;
+}
+
+// fill in the page at va in mapping v, or let a write to a
+// read-only shared file page through and mark it dirty.
+// returns the physical address, or 0.
+uint64
+mmapfault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  int perm;
+
+  if((v->prot & PROT_READ) == 0 || (write && (v->prot & PROT_WRITE) == 0))
+    return 0;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(!write || (*pte & PTE_W))
+      return 0;
+    *pte |= PTE_W | PTE_D;
+    uvmflush(p->pagetable, va);
+    return PTE2PA(*pte);
+  }
+
+  perm = PTE_R | PTE_U;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if(v->f && v->f->type == FD_SHM){
+    // map the object's own page; it's always shared.
+    if((mem = shmpage(v->f->shm, v->off + (va - v->addr))) == 0)
+      return 0;
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return 0;
+    }
+    return (uint64)mem;
+  }
+
+  if(v->f && (v->flags & MAP_SHARED)){
+    // the page cache's page, so that every process mapping
+    // it, before or after a fork(), sees the same one.
+    // off is page-aligned, since mmap() requires v->off to be.
+    ilock(v->f->ip);
+    mem = pcget(v->f->ip, (v->off + (va - v->addr)) / PGSIZE);
+    iunlock(v->f->ip);
+    if(mem == 0)
+      return 0;
+  } else {
+    if((mem = ualloc()) == 0)
+      return 0;
+    memset(mem, 0, PGSIZE);
+    if(v->f){
+      ilock(v->f->ip);
+      if(readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE) < 0){
+        iunlock(v->f->ip);
+        kfree(mem);
+        return 0;
+      }
+      iunlock(v->f->ip);
+    }
+  }
+
+  if(v->prot & PROT_WRITE){
+    if(v->f == 0 || (v->flags & MAP_PRIVATE))
+      perm |= PTE_W;
+    else if(write)
+      perm |= PTE_W | PTE_D;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
@@ -1,13 +1,25 @@
 #define NPROC        64  // maximum number of processes
-#define NCPU          8  // maximum number of CPUs
+#define NCPU        256  // maximum number of CPUs (PLIC contexts mapped)
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
+#define NSHM        16  // shared-memory objects per system
+#define SHMPAGES  1024  // maximum pages per shared-memory object
+#define SHMNAME     16  // shared-memory object name length
+#define NVMA        16  // memory mappings per process
+#define NSEG         4  // maximum loadable segments per program
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define NSPAWNACT    16  // max file actions per spawn()
+#define MAXOPBLOCKS  10  // blocks an FS op may write, unless it reserves more
+#define LOGSIZE      253   // max data blocks in on-disk log; fills a commit record
+#define LOGAGE       10    // ticks before committed blocks are checkpointed
+#define LOGDIRTY     50    // or once they fill this percent of the log
+#define LOGCOMMIT    3     // ticks a transaction may take new FS calls
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS)  // minimum size of disk block cache
+#define BCACHEFRAC   64    // disk block cache gets 1/BCACHEFRAC of RAM
+#define NREADAHEAD   4     // pages read ahead of sequential file reads
+#define FSSIZE       4000  // size of file system in blocks
+#define SWAPSIZE    16384  // size of swap area in blocks, after the file system
 #define MAXPATH      128   // maximum file path name
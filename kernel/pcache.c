@@ -0,0 +1,347 @@
+//
+// the page cache, for file data.
+//
+// readi() copies file data out of whole pages cached here,
+// rather than through the buffer cache, which is left for
+// file-system metadata: the log, inode and bitmap blocks,
+// and indirect blocks, except when there's no memory for a
+// page. each inode has a radix tree of its cached pages
+// (ip->pc), keyed by page index in the file.
+// a tree node is a page of 512 pointers, so one level is
+// enough for files up to 2MB, and the tree grows taller if
+// need be.
+//
+// pages are filled from the disk, or from the buffer cache
+// if a block is there, since a block that has been written
+// but not yet installed by the log is newer there. writei()
+// still writes through the buffer cache and the log, and
+// also updates any cached page it writes to, so cached
+// pages are never dirty and can be dropped at any time,
+// except those of files with MAP_SHARED mappings, which
+// map the cache's pages and write to them (see mmap.c).
+//
+// when pcget() misses on the page after the last one it
+// was asked for, reads look sequential, and it starts the
+// disk reading the NREADAHEAD pages after that into the
+// buffer cache, so they are there when pcfill() wants them;
+// each page once, not again on every later miss. pcfill()
+// reads the blocks of a page that aren't in the buffer
+// cache straight into the page, in one disk request, so
+// only what was read ahead passes through the buffer cache.
+//
+// vmfault() maps cached pages of programs' read-only text
+// straight into the processes running them, so they share
+// one copy. a mapped page holds its own reference, and
+// outlives being dropped from the cache. it can't go stale,
+// since nothing may write to the file of a running program.
+//
+// the cache uses whatever memory is free. kalloc() calls
+// pcreclaim() when it runs out, to give back the pages of
+// an inode, preferring ones nobody has open, and never
+// those of an inode with shared mappings. iget() drops
+// the pages of an inode slot when it reuses it for another
+// file, and itrunc() when it truncates one.
+//
+// pcache.lock protects every tree, since vmfault() reads
+// executables without holding the inode lock. a page handed
+// out by pcget() carries a reference for the caller, so that
+// it stays put while the caller copies from it, even if it is
+// dropped from the cache meanwhile. kalloc() must never be
+// called with pcache.lock held.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define PCBITS 9
+#define PCFAN  (1 << PCBITS)   // pointers per tree node
+
+struct {
+  struct spinlock lock;
+  struct inode *ips[NINODE];   // inodes with cached pages
+  int hand;                    // where pcreclaim() looks next
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// pages a tree of height h can hold.
+static uint64
+pccap(int h)
+{
+  return 1L << (PCBITS * h);
+}
+
+// the slot for page idx in ip's tree, or 0 if there is none.
+// if alloc, fill in missing nodes, using *spare; return 0 if
+// another node is needed and *spare is 0.
+// pcache.lock must be held.
+static void **
+pcslot(struct inode *ip, uint idx, int alloc, void **spare)
+{
+  struct pctree *t = &ip->pc;
+  void **node;
+
+  if(t->root == 0 || idx >= pccap(t->height)){
+    if(!alloc)
+      return 0;
+    if(t->root == 0){
+      // first page: register the inode with pcreclaim().
+      if(*spare == 0)
+        return 0;
+      for(int i = 0; i < NINODE; i++){
+        if(pcache.ips[i] == 0){
+          pcache.ips[i] = ip;
+          break;
+        }
+      }
+      t->root = *spare;
+      *spare = 0;
+      t->height = 1;
+    }
+    while(idx >= pccap(t->height)){
+      if(*spare == 0)
+        return 0;
+      node = *spare;
+      *spare = 0;
+      node[0] = t->root;
+      t->root = node;
+      t->height++;
+    }
+  }
+
+  node = t->root;
+  for(int level = t->height - 1; level > 0; level--){
+    void **slot = &node[(idx >> (PCBITS * level)) & (PCFAN - 1)];
+    if(*slot == 0){
+      if(!alloc || *spare == 0)
+        return 0;
+      *slot = *spare;
+      *spare = 0;
+    }
+    node = *slot;
+  }
+  return &node[idx & (PCFAN - 1)];
+}
+
+// free a subtree of height h and the pages in it.
+static void
+pcfree(void **node, int h)
+{
+  for(int i = 0; i < PCFAN; i++){
+    if(node[i] == 0)
+      continue;
+    if(h > 1)
+      pcfree(node[i], h - 1);
+    else
+      kfree(node[i]);
+  }
+  kfree(node);
+}
+
+// drop all of ip's cached pages. pcache.lock must be held.
+static void
+pcdrop1(struct inode *ip)
+{
+  if(ip->pc.root == 0)
+    return;
+  pcfree(ip->pc.root, ip->pc.height);
+  ip->pc.root = 0;
+  ip->pc.height = 0;
+  for(int i = 0; i < NINODE; i++)
+    if(pcache.ips[i] == ip)
+      pcache.ips[i] = 0;
+}
+
+void
+pcdrop(struct inode *ip)
+{
+  acquire(&pcache.lock);
+  pcdrop1(ip);
+  release(&pcache.lock);
+}
+
+// give back the cached pages of one inode, preferring one
+// that isn't open, and skipping ones with MAP_SHARED
+// mappings. called by kalloc() when memory runs out.
+// returns 1 if it freed anything, 0 if there was nothing
+// it could free.
+int
+pcreclaim(void)
+{
+  struct inode *ip, *any = 0;
+
+  acquire(&pcache.lock);
+  for(int n = 0; n < NINODE; n++){
+    ip = pcache.ips[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NINODE;
+    if(ip == 0 || ip->nmap > 0)
+      continue;
+    if(any == 0)
+      any = ip;
+    // a racy look at ref, but it's only a preference.
+    if(ip->ref == 0){
+      any = ip;
+      break;
+    }
+  }
+  if(any)
+    pcdrop1(any);
+  release(&pcache.lock);
+  return any != 0;
+}
+
+// is page idx of ip cached?
+static int
+pccached(struct inode *ip, uint idx)
+{
+  void **slot;
+  void *spare = 0;
+  int r;
+
+  acquire(&pcache.lock);
+  r = (slot = pcslot(ip, idx, 0, &spare)) != 0 && *slot != 0;
+  release(&pcache.lock);
+  return r;
+}
+
+// start reading page idx of ip into the buffer cache, and
+// don't wait. stops at the end of the file.
+// the caller holds ip->lock, or itext() keeps ip from changing.
+static void
+pcreadahead(struct inode *ip, uint idx)
+{
+  uint bn = idx * (PGSIZE / BSIZE);
+  uint addr;
+
+  for(int i = 0; i < PGSIZE / BSIZE && bn * BSIZE < ip->size; i++, bn++)
+    if((addr = bmap(ip, bn)) != 0)
+      breadahead(ip->dev, addr);
+}
+
+// read page idx of ip into mem: blocks that are in the
+// buffer cache from there, since they may be newer than on
+// disk, and each run of the rest that lie together on disk
+// in one request.
+// the caller holds ip->lock, or itext() keeps ip from changing.
+static int
+pcfill(struct inode *ip, uint idx, char *mem)
+{
+  uint bn = idx * (PGSIZE / BSIZE);
+  uint addr[PGSIZE / BSIZE];
+  int i, n;
+
+  for(i = 0; i < PGSIZE / BSIZE; i++, bn++){
+    addr[i] = 0;
+    if(bn * BSIZE >= ip->size){
+      memset(mem + i*BSIZE, 0, BSIZE);
+      continue;
+    }
+    if((addr[i] = bmap(ip, bn)) == 0)
+      return -1;
+    if(bpeek(ip->dev, addr[i], mem + i*BSIZE))
+      addr[i] = 0;
+  }
+  for(i = 0; i < PGSIZE / BSIZE; i += n){
+    n = 1;
+    if(addr[i] == 0)
+      continue;
+    while(i + n < PGSIZE / BSIZE && addr[i+n] == addr[i] + n)
+      n++;
+    brwn(ip->dev, addr[i], mem + i*BSIZE, n, 0);
+  }
+  return 0;
+}
+
+// return page idx of ip's data, with a reference for the
+// caller to drop with kfree() when done with it.
+// reads the page in if need be. returns 0 if there's no
+// memory for it, or it can't be read.
+char *
+pcget(struct inode *ip, uint idx)
+{
+  void **slot;
+  void *spare = 0;
+  char *mem;
+  int seq;
+
+  // racy when vmfault() calls without ip->lock, but it's
+  // only a hint.
+  seq = idx == ip->ranext;
+  ip->ranext = idx + 1;
+  if(!seq)
+    ip->raend = 0;
+
+  acquire(&pcache.lock);
+  if((slot = pcslot(ip, idx, 0, &spare)) != 0 && *slot != 0){
+    mem = kdup(*slot);
+    release(&pcache.lock);
+    return mem;
+  }
+  release(&pcache.lock);
+
+  if(seq){
+    // only the pages not read ahead already.
+    for(uint i = idx + 1 > ip->raend ? idx + 1 : ip->raend; i <= idx + NREADAHEAD; i++)
+      if((uint64)i * PGSIZE < ip->size && !pccached(ip, i))
+        pcreadahead(ip, i);
+    ip->raend = idx + NREADAHEAD + 1;
+  }
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  if(pcfill(ip, idx, mem) < 0){
+    kfree(mem);
+    return 0;
+  }
+
+  for(;;){
+    acquire(&pcache.lock);
+    if((slot = pcslot(ip, idx, 1, &spare)) != 0)
+      break;
+    release(&pcache.lock);
+    if((spare = kalloc()) == 0)
+      return mem; // uncached, but good for the caller
+    memset(spare, 0, PGSIZE);
+  }
+  if(*slot == 0){
+    *slot = mem;
+    kdup(mem);
+  } else {
+    // someone else read it in meanwhile.
+    kfree(mem);
+    mem = kdup(*slot);
+  }
+  release(&pcache.lock);
+  if(spare)
+    kfree(spare);
+  return mem;
+}
+
+// writei() has written n bytes at off in ip, from src;
+// update the cached page, if there is one.
+void
+pcwrite(struct inode *ip, uint off, char *src, uint n)
+{
+  void **slot;
+  void *spare = 0;
+  char *pg = 0;
+
+  acquire(&pcache.lock);
+  if((slot = pcslot(ip, off / PGSIZE, 0, &spare)) != 0 && *slot != 0)
+    pg = kdup(*slot);
+  release(&pcache.lock);
+  if(pg){
+    memmove(pg + off % PGSIZE, src, n);
+    kfree(pg);
+  }
+}
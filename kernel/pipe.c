@@ -79,6 +79,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   int i = 0;
   struct proc *pr = myproc();
 
+  uvmprefault(pr->pagetable, addr, n);
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
@@ -109,6 +110,7 @@ piperead(struct pipe *pi, uint64 addr, int n)
   struct proc *pr = myproc();
   char ch;
 
+  uvmprefault(pr->pagetable, addr, n);
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
@@ -5,8 +5,13 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
 
-struct cpu cpus[NCPU];
+// per-CPU state, one per hart found by fdtinit().
+// printf() and acquire() use mycpu() before cpuinit()
+// can allocate the array, so hart 0 starts on bootcpu.
+static struct cpu bootcpu;
+struct cpu *cpus = &bootcpu;
 
 struct proc proc[NPROC];
 
@@ -50,6 +55,18 @@ struct proc * cfs_current_proc = 0; //the process currently scheduled to run by
 int cfs_proc_timeslice_len = 0; //number of timeslices assigned to the above process
 int cfs_proc_timeslice_left = 0; //number of timeslices that the above process can still run
 
+// Size the per-CPU array by the number of harts.
+// Called on hart 0 before the others start.
+void
+cpuinit(void)
+{
+  struct cpu *c;
+
+  c = bootalloc(ncpu * sizeof(struct cpu));
+  c[0] = *cpus;
+  cpus = c;
+}
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -164,6 +181,14 @@ found:
     return 0;
   }
 
+  // A kernel page table, for running in the kernel.
+  p->kpagetable = kvmcreate();
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -185,7 +210,14 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  if(p->kpagetable)
+    kvmfree(p->kpagetable);
+  p->kpagetable = 0;
   p->sz = 0;
+  p->superlo = p->superhi = 0;
+  p->asidgen = 0;
+  p->execip = 0;
+  p->kfn = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -268,6 +300,7 @@ userinit(void)
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
   p->sz = PGSIZE;
+  kvmsync(p);
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -281,21 +314,67 @@ userinit(void)
   release(&p->lock);
 }
 
+// a kernel thread starts here, from the scheduler.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// start a kernel thread that runs fn(), which must never
+// return. it is a process with no user memory, which never
+// leaves the kernel, and has no parent.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates
+// each page when the process first touches it.
+// the whole 2MB chunks of a grow are noted in
+// p->superlo and p->superhi, where vmfault() may
+// use megapages.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, lo, hi;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n < sz || sz + n > mmapbase(p))
       return -1;
+    sz += n;
+    lo = SUPERPGROUNDUP(p->sz);
+    hi = SUPERPGROUNDDOWN(sz);
+    if(hi > lo){
+      if(p->superhi != lo)
+        p->superlo = lo;
+      p->superhi = hi;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz)
+      return -1;
+    if(p->superhi > SUPERPGROUNDDOWN(sz))
+      p->superhi = SUPERPGROUNDDOWN(sz);
+    if(p->superhi <= p->superlo)
+      p->superlo = p->superhi = 0;
   }
   p->sz = sz;
   return 0;
@@ -311,17 +390,34 @@ fork(void)
   struct proc *p = myproc();
 
   // Allocate process.
+ retry:
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
+  // Copy user memory from parent to child. if there isn't
+  // memory for the child's page tables, page something out
+  // and try again; that can't be done holding np->lock.
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
+    if(swapout() == 0)
+      goto retry;
     return -1;
   }
   np->sz = p->sz;
+  np->superlo = p->superlo;
+  np->superhi = p->superhi;
+
+  if(mmapdup(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    if(swapout() == 0)
+      goto retry;
+    return -1;
+  }
+
+  kvmsync(np);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -334,6 +430,11 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->execip){
+    np->execip = idup(p->execip);
+    itext(np->execip, 1);
+    memmove(np->segs, p->segs, sizeof(p->segs));
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -352,6 +453,97 @@ fork(void)
   return pid;
 }
 
+// apply spawn()'s file actions to np's open files.
+// closing a descriptor that isn't open is fine.
+// returns 0, or -1 if an action is bad.
+static int
+spawnfds(struct proc *np, struct spawnact *acts, int nact)
+{
+  struct spawnact *a;
+
+  for(a = acts; a < &acts[nact]; a++){
+    if(a->fd < 0 || a->fd >= NOFILE)
+      return -1;
+    switch(a->op){
+    case SPAWN_CLOSE:
+      if(np->ofile[a->fd]){
+        fileclose(np->ofile[a->fd]);
+        np->ofile[a->fd] = 0;
+      }
+      break;
+    case SPAWN_DUP2:
+      if(a->newfd < 0 || a->newfd >= NOFILE || np->ofile[a->fd] == 0)
+        return -1;
+      if(a->newfd == a->fd)
+        break;
+      if(np->ofile[a->newfd])
+        fileclose(np->ofile[a->newfd]);
+      np->ofile[a->newfd] = filedup(np->ofile[a->fd]);
+      break;
+    default:
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Create a new process running the program in path, without
+// copying the parent's memory only to throw it away, as
+// fork() then exec() would. the child starts with the
+// parent's open files, changed by the nact actions in acts.
+// returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawnact *acts, int nact)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  pid = np->pid;
+
+  // exec() sleeps, so it can't be called holding np->lock;
+  // nothing else touches np while it is USED.
+  release(&np->lock);
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  // exec() looks path up in p's cwd, which is np's too.
+  if(spawnfds(np, acts, nact) < 0 || (argc = exec(np, path, argv)) < 0){
+    for(i = 0; i < NOFILE; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -378,6 +570,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop memory mappings.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -389,8 +584,13 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->execip){
+    itext(p->execip, -1);
+    iput(p->execip);
+  }
   end_op();
   p->cwd = 0;
+  p->execip = 0;
 
   acquire(&wait_lock);
 
@@ -421,6 +621,8 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
@@ -571,7 +773,9 @@ void cfs_scheduler(struct cpu *c)
         //schedule c->process to run 
         acquire(&c->proc->lock); 
         c->proc->state=RUNNING; 
+        kvmswitch(c->proc); 
         swtch(&c->context, &c->proc->context); 
+        kvmswitch(0); 
         release(&c->proc->lock); 
     } 
   }
@@ -596,7 +800,9 @@ old_scheduler(struct cpu *c)
         // before jumping back to us. 
         p->state = RUNNING; 
         c->proc = p; 
+        kvmswitch(p); 
         swtch(&c->context, &p->context); 
+        kvmswitch(0); 
   
         // Process is done running for now. 
         // It should have changed its p->state before coming back. 
@@ -820,6 +1026,7 @@ procdump(void)
   };
   struct proc *p;
   char *state;
+  int rss, swapped;
 
   printf("\n");
   for(p = proc; p < &proc[NPROC]; p++){
@@ -830,6 +1037,10 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    if(p->pagetable){
+      uvmcount(p->pagetable, &rss, &swapped);
+      printf(" rss %dK swap %dK", rss * (PGSIZE/1024), swapped * (PGSIZE/1024));
+    }
     printf("\n");
   }
 }
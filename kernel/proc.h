@@ -24,9 +24,10 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this hart's TLB is flushed for
 };
 
-extern struct cpu cpus[NCPU];
+extern struct cpu *cpus; // ncpu of them, indexed by hartid
 
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
@@ -79,6 +80,26 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// a loadable ELF segment of the running program,
+// paged in from p->execip by vmfault().
+struct seg {
+  uint64 va;                   // page-aligned start
+  uint64 memsz;                // bytes of memory
+  uint64 filesz;               // bytes read from the file; the rest is zero
+  uint64 off;                  // offset in the file
+  int perm;                    // PTE_R|PTE_U plus PTE_W, PTE_X
+};
+
+// a memory mapping made by mmap(); see mmap.c.
+struct vma {
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // bytes, a multiple of PGSIZE; 0 if free
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // mapped file, or 0 if anonymous
+  uint off;                    // offset in f of addr
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -95,15 +116,29 @@ struct proc {
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
-  // these are private to the process, so p->lock need not be held.
+  // these are private to the process, so p->lock need not be held,
+  // except that swapout() may page out user memory, with p->lock
+  // held, while the process isn't running.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 superlo, superhi;     // Heap sbrk() grew 2MB-aligned chunks of; may use megapages
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, with pagetable at USERALIAS
+  uint64 asid;                 // ASID of pagetable, if asidgen is current; asid+1 is kpagetable's
+  uint64 asidgen;              // ASID generation asid belongs to; 0 if none
+  int tlbcpu;                  // Hart that last ran with asid and asid+1
+  uint64 pinva, pinlen;        // Range uvmprefault() faulted in; not paged out
+  int inuser;                  // Preempted in user mode, with no kernel work half done
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *execip;        // Program file, for paging in segs
+  struct seg segs[NSEG];       // Program's loadable segments
+  struct vma vmas[NVMA];       // mmap() mappings
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // What a kernel thread runs, or 0
+  int logres;                  // Log blocks begin_op() reserved
 
   // track number of times the process if swapped off CPU
   int swapcount;
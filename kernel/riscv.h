@@ -42,6 +42,10 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_MXR (1L << 19) // Make eXecutable Readable
+#define SSTATUS_VS (3L << 9)   // Vector unit state; 0 = off
+#define SSTATUS_VS_INIT (1L << 9)
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User Memory
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -199,7 +203,12 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+// the address-space ID tags TLB entries, so that switching
+// page tables needn't flush them. the kernel uses ASID 0.
+#define SATP_ASIDSHIFT 44
+#define SATP_ASIDMAX 0xFFFFL
+
+#define MAKE_SATP(pagetable, asid) (SATP_SV39 | ((uint64)(asid) << SATP_ASIDSHIFT) | (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -256,7 +265,8 @@ r_mcounteren()
   return x;
 }
 
-// machine-mode cycle counter
+// the real-time counter; supervisor mode may read it
+// since start() sets mcounteren.TM.
 static inline uint64
 r_time()
 {
@@ -327,6 +337,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries for one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush the TLB entries for one page of one address space.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -338,11 +362,25 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define SUPERPGSIZE (512*PGSIZE) // bytes per 2MB megapage
+#define SUPERPGROUNDUP(sz)  (((sz)+SUPERPGSIZE-1) & ~(SUPERPGSIZE-1))
+#define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // RSW bit: copy-on-write, write faults copy
+#define PTE_SUPER (1L << 9) // RSW bit: a level-1 leaf, mapping a megapage
+
+// a PTE without PTE_V, for a page that is in swap, holds
+// its swap slot where the PPN would be; see swap.c.
+#define PTE_SWAP (1L << 63)
+#define SLOT2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SLOT(pte) (((pte) >> 10) & 0xFFFFFFFFFFFL)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,130 @@
+//
+// named shared-memory objects.
+//
+// shm_open(name, size) returns a file descriptor for the
+// object called name, creating it if need be. mapping the
+// descriptor, with shm_attach() or mmap(MAP_SHARED), maps
+// the object's physical pages into the process, so any
+// number of processes can exchange data without copying
+// it through the kernel.
+//
+// pages are allocated on first touch, and each mapping
+// holds a kalloc reference on the pages it maps. an object
+// lives as long as an open file refers to it (mappings
+// hold one too), so its pages and its name go away when
+// the last process closes or unmaps it.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+
+struct shm {
+  char name[SHMNAME];
+  int ref;               // open files referring to it; 0 if free
+  uint64 npages;
+  char *pages[SHMPAGES]; // 0 until first touched
+};
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shm");
+}
+
+// find or create the object called name, of size bytes,
+// and return it with a new reference.
+// an existing object must be at least size bytes.
+// a 0 name creates an object no one else can find, to
+// back an anonymous MAP_SHARED mapping.
+struct shm*
+shmget(char *name, uint64 size)
+{
+  struct shm *s, *empty = 0;
+
+  if(size == 0 || size > SHMPAGES*PGSIZE || (name && name[0] == 0))
+    return 0;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.shm; s < &shmtable.shm[NSHM]; s++){
+    if(name && s->ref > 0 && strncmp(s->name, name, SHMNAME) == 0){
+      if(size > s->npages*PGSIZE){
+        release(&shmtable.lock);
+        return 0;
+      }
+      s->ref++;
+      release(&shmtable.lock);
+      return s;
+    }
+    if(empty == 0 && s->ref == 0)
+      empty = s;
+  }
+  if((s = empty) != 0){
+    if(name)
+      safestrcpy(s->name, name, SHMNAME);
+    s->ref = 1;
+    s->npages = PGROUNDUP(size) / PGSIZE;
+  }
+  release(&shmtable.lock);
+  return s;
+}
+
+// drop a reference; the last one frees the object's pages.
+// pages still mapped stay allocated until they're unmapped.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref > 0){
+    release(&shmtable.lock);
+    return;
+  }
+  for(int i = 0; i < s->npages; i++){
+    if(s->pages[i])
+      kfree(s->pages[i]);
+    s->pages[i] = 0;
+  }
+  s->name[0] = 0;
+  s->npages = 0;
+  release(&shmtable.lock);
+}
+
+uint64
+shmsize(struct shm *s)
+{
+  return s->npages * PGSIZE;
+}
+
+// the physical page at byte offset off in s, allocating it
+// if need be, with a new reference for the caller to map.
+// returns 0 if off is past the end or there's no memory.
+char*
+shmpage(struct shm *s, uint64 off)
+{
+  uint64 i = off / PGSIZE;
+  char *pa;
+
+  acquire(&shmtable.lock);
+  if(i >= s->npages){
+    release(&shmtable.lock);
+    return 0;
+  }
+  if(s->pages[i] == 0 && (s->pages[i] = kalloc()) != 0)
+    memset(s->pages[i], 0, PGSIZE);
+  if((pa = s->pages[i]) != 0)
+    kdup(pa);
+  release(&shmtable.lock);
+  return pa;
+}
@@ -71,6 +71,19 @@ release(struct spinlock *lk)
   pop_off();
 }
 
+// Check whether this cpu is holding any spinlock,
+// and so mustn't sleep.
+int
+holdingany(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // Check whether this cpu is holding the lock.
 // Interrupts must be off.
 int
@@ -7,19 +7,33 @@
 void main();
 void timerinit();
 
-// entry.S needs one stack per CPU.
-__attribute__ ((aligned (16))) char stack0[4096 * NCPU];
+// entry.S needs a stack for hart 0 to boot on.
+__attribute__ ((aligned (16))) char stack0[4096];
+
+// the other harts wait in entry.S until bootharts()
+// sets this to an array of one 4096-byte stack per hart.
+uint64 hartstacks;
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+// hart 0 runs timerinit() before main() has counted the
+// harts, so it gets a static one.
+static uint64 timer_scratch0[5];
+uint64 (*timer_scratch)[5];
+
+// physical address of the device tree blob from qemu.
+uint64 dtb;
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
 // entry.S jumps here in machine mode on stack0.
+// qemu puts the hartid in a0 and the device tree address in a1.
 void
-start()
+start(uint64 hartid, uint64 fdt)
 {
+  if(hartid == 0)
+    dtb = fdt;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
@@ -46,6 +60,9 @@ start()
   // ask for clock interrupts.
   timerinit();
 
+  // let supervisor mode read the time CSR, for r_time().
+  w_mcounteren(r_mcounteren() | 2);
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -73,7 +90,7 @@ timerinit()
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
-  uint64 *scratch = &timer_scratch[id][0];
+  uint64 *scratch = id == 0 ? timer_scratch0 : &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
   w_mscratch((uint64)scratch);
@@ -87,3 +104,20 @@ timerinit()
   // enable machine-mode timer interrupts.
   w_mie(r_mie() | MIE_MTIE);
 }
+
+// called by main() on hart 0 once fdtinit() knows ncpu.
+// allocate stacks and timer scratch areas for the other
+// harts, then release them from entry.S.
+void
+bootharts(void)
+{
+  char *stacks;
+
+  timer_scratch = bootalloc(ncpu * sizeof(timer_scratch[0]));
+  stacks = bootalloc(ncpu * 4096);
+
+  // make sure the other harts see the scratch
+  // areas before they see their stacks.
+  __sync_synchronize();
+  hartstacks = (uint64)stacks;
+}
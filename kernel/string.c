@@ -1,13 +1,69 @@
 #include "types.h"
+#include "riscv.h"
+#include "defs.h"
+
+// memset(), memmove() and memcmp() go a 64-bit word at a
+// time, four words per loop, once the pointers are aligned.
+// that needs dst and src to be aligned alike, as pages and
+// block buffers are; otherwise they go a byte at a time.
+// with RVV, long runs use the vector unit instead.
+
+#define WORD sizeof(uint64)
+
+// both aligned alike?
+#define ALIKE(a, b) ((((uint64)(a) ^ (uint64)(b)) & (WORD-1)) == 0)
+
+#ifdef RVV
+// shorter than this isn't worth turning the vector unit on.
+#define VECMIN 256
+
+// vstring.S clobbers the vector registers, which nothing
+// saves, so keep interrupts off while the unit is on.
+static void
+vecon(void)
+{
+  push_off();
+  w_sstatus(r_sstatus() | SSTATUS_VS_INIT);
+}
+
+static void
+vecoff(void)
+{
+  w_sstatus(r_sstatus() & ~SSTATUS_VS);
+  pop_off();
+}
+#endif
 
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+#ifdef RVV
+  if(rvv && n >= VECMIN){
+    vecon();
+    vmemset(dst, c, n);
+    vecoff();
+    return dst;
   }
+#endif
+
+  for(; n > 0 && ((uint64)cdst & (WORD-1)); n--)
+    *cdst++ = c;
+  w = (uchar)c * 0x0101010101010101UL;
+  wdst = (uint64 *) cdst;
+  for(; n >= 4*WORD; n -= 4*WORD, wdst += 4){
+    wdst[0] = w;
+    wdst[1] = w;
+    wdst[2] = w;
+    wdst[3] = w;
+  }
+  for(; n >= WORD; n -= WORD)
+    *wdst++ = w;
+  cdst = (char *) wdst;
+  for(; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +74,24 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+#ifdef RVV
+  if(rvv && n >= VECMIN){
+    int r;
+    vecon();
+    r = vmemcmp(v1, v2, n);
+    vecoff();
+    return r;
+  }
+#endif
+  if(ALIKE(s1, s2)){
+    for(; n > 0 && ((uint64)s1 & (WORD-1)); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip the equal words; the bytes find the difference.
+    for(; n >= WORD; n -= WORD, s1 += WORD, s2 += WORD)
+      if(*(uint64 *)s1 != *(uint64 *)s2)
+        break;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,6 +106,7 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  uint64 w0, w1, w2, w3;
 
   if(n == 0)
     return dst;
@@ -41,11 +116,59 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(ALIKE(s, d)){
+      for(; n > 0 && ((uint64)d & (WORD-1)); n--)
+        *--d = *--s;
+      // load all four before storing any, since they overlap.
+      for(; n >= 4*WORD; n -= 4*WORD){
+        s -= 4*WORD;
+        d -= 4*WORD;
+        w3 = ((uint64 *)s)[3];
+        w2 = ((uint64 *)s)[2];
+        w1 = ((uint64 *)s)[1];
+        w0 = ((uint64 *)s)[0];
+        ((uint64 *)d)[3] = w3;
+        ((uint64 *)d)[2] = w2;
+        ((uint64 *)d)[1] = w1;
+        ((uint64 *)d)[0] = w0;
+      }
+      for(; n >= WORD; n -= WORD){
+        s -= WORD;
+        d -= WORD;
+        *(uint64 *)d = *(uint64 *)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+#ifdef RVV
+    // forward is safe even if they overlap, as d < s.
+    if(rvv && n >= VECMIN){
+      vecon();
+      vmemcpy(d, s, n);
+      vecoff();
+      return dst;
+    }
+#endif
+    if(ALIKE(s, d)){
+      for(; n > 0 && ((uint64)d & (WORD-1)); n--)
+        *d++ = *s++;
+      for(; n >= 4*WORD; n -= 4*WORD, s += 4*WORD, d += 4*WORD){
+        w0 = ((uint64 *)s)[0];
+        w1 = ((uint64 *)s)[1];
+        w2 = ((uint64 *)s)[2];
+        w3 = ((uint64 *)s)[3];
+        ((uint64 *)d)[0] = w0;
+        ((uint64 *)d)[1] = w1;
+        ((uint64 *)d)[2] = w2;
+        ((uint64 *)d)[3] = w3;
+      }
+      for(; n >= WORD; n -= WORD, s += WORD, d += WORD)
+        *(uint64 *)d = *(uint64 *)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
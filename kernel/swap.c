@@ -0,0 +1,273 @@
+//
+// paging user memory out to swap.
+//
+// mkfs leaves an area of the disk after the file system for
+// swap (sb.swapstart, sb.nswap), divided here into page-sized
+// slots. when kalloc() runs dry, ualloc() calls swapout(),
+// which sweeps a clock hand over the user pages of processes
+// that aren't running, giving pages that have been used since
+// the last sweep (PTE_A) a second chance. it writes the page
+// it picks to a free slot and leaves the slot number in the
+// PTE, with PTE_SWAP set and PTE_V clear, so the next touch
+// faults and vmfault() calls swapin() to read the page back.
+//
+// only pages with a single reference are paged out: not
+// copy-on-write or MAP_SHARED pages, nor megapages. a slot
+// can have several references, when fork() copies a PTE for
+// a page that is in swap; each reads its own copy back.
+//
+// swapout() changes the page tables of processes that aren't
+// running, holding p->lock so they can't start. a process
+// that is asleep in the kernel may be partway through a
+// system call, though, and about to copy to or from user
+// memory while holding a spinlock, when it can't sleep to
+// page anything in; so uvmprefault() records the range it
+// faulted in, and swapout() leaves that alone.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)
+#define NSLOT (SWAPSIZE / SLOTBLOCKS)
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;           // first block of the swap area
+  int nslot;
+  uchar ref[NSLOT];     // PTEs referring to each slot
+  uchar busy[NSLOT];    // being written out
+} swap;
+
+// the clock hand.
+struct {
+  struct sleeplock lock;
+  struct proc *p;
+  uint64 va;
+} swapper;
+
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swapper.lock, "swapper");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  swapper.p = proc;
+}
+
+// allocate a slot, marked busy until swapout() has
+// written it. returns -1 if swap is full.
+static int
+slotalloc(void)
+{
+  acquire(&swap.lock);
+  for(int i = 0; i < swap.nslot; i++){
+    if(swap.ref[i] == 0 && !swap.busy[i]){
+      swap.ref[i] = 1;
+      swap.busy[i] = 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// another PTE refers to slot.
+void
+swapdup(uint64 slot)
+{
+  acquire(&swap.lock);
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// a PTE no longer refers to slot. doesn't sleep, so
+// uvmunmap() can call it with locks held.
+void
+swapfree(uint64 slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] < 1)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// read or write the page at pa from or to slot.
+static void
+swaprw(uint64 slot, char *pa, int write)
+{
+  for(int i = 0; i < SLOTBLOCKS; i++)
+    brw(swap.dev, swap.start + slot*SLOTBLOCKS + i, pa + i*BSIZE, write);
+}
+
+// may swapout() take p's pages? p->lock must be held.
+// its kernel half mustn't be in the middle of changing
+// its page table, as it may be if it was preempted in
+// the kernel.
+static int
+swappable(struct proc *p)
+{
+  if(p->pagetable == 0)
+    return 0;
+  if(p == myproc())
+    return 1;
+  return p->state == SLEEPING || (p->state == RUNNABLE && p->inuser);
+}
+
+// the next user page at or above *va in pagetable, or 0.
+// skips megapages.
+static pte_t *
+nextpte(pagetable_t pagetable, uint64 *va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+
+  while(*va < TRAPFRAME){
+    pte = &pagetable[PX(2, *va)];
+    if((*pte & PTE_V) == 0){
+      *va = (*va + (1L << PXSHIFT(2))) & ~((1L << PXSHIFT(2)) - 1);
+      continue;
+    }
+    pt = (pagetable_t)PTE2PA(*pte);
+    pte = &pt[PX(1, *va)];
+    if((*pte & PTE_V) == 0 || (*pte & PTE_SUPER)){
+      *va = SUPERPGROUNDDOWN(*va) + SUPERPGSIZE;
+      continue;
+    }
+    pt = (pagetable_t)PTE2PA(*pte);
+    pte = &pt[PX(0, *va)];
+    if((*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U))
+      return pte;
+    *va += PGSIZE;
+  }
+  return 0;
+}
+
+// sweep the clock hand on to a page that hasn't been used
+// lately, and put slot in its PTE in place of the page.
+// returns the page, or 0 if two times round found nothing.
+// the caller must hold swapper.lock.
+static uint64
+swapvictim(uint64 slot)
+{
+  struct proc *p;
+  struct vma *v;
+  pte_t *pte;
+  uint64 pa;
+  int flush;
+
+  for(int n = 0; n < 2*NPROC + 1; n++){
+    p = swapper.p;
+    acquire(&p->lock);
+    flush = 0;
+    while(swappable(p) && (pte = nextpte(p->pagetable, &swapper.va)) != 0){
+      uint64 va = swapper.va;
+      swapper.va += PGSIZE;
+      pa = PTE2PA(*pte);
+      if(krefcnt((void*)pa) != 1)
+        continue;
+      if(p->pinlen && va + PGSIZE > p->pinva && va < p->pinva + p->pinlen)
+        continue;
+      if((v = vmalookup(p, va)) != 0 && (v->flags & MAP_SHARED))
+        continue;
+      if(*pte & PTE_A){
+        // used since we last looked: a second chance.
+        *pte &= ~PTE_A;
+        uvmflush(p->pagetable, va);
+        flush = 1;
+        continue;
+      }
+      *pte = SLOT2PTE(slot) | PTE_SWAP | (PTE_FLAGS(*pte) & ~PTE_V);
+      uvmflush(p->pagetable, va);
+      if(p != myproc())
+        p->asidgen = 0; // new ASIDs, so no hart has stale entries
+      release(&p->lock);
+      return pa;
+    }
+    if(flush && p != myproc()){
+      // so the TLB notices when the page is next used.
+      p->asidgen = 0;
+    }
+    release(&p->lock);
+    swapper.p = (swapper.p == &proc[NPROC-1]) ? proc : swapper.p + 1;
+    swapper.va = 0;
+  }
+  return 0;
+}
+
+// page out one user page, so its memory can be reused.
+// may sleep, so the caller must hold no spinlocks.
+// returns 0, or -1 if there's no page or slot to be had.
+int
+swapout(void)
+{
+  uint64 pa;
+  int slot;
+
+  if(swap.nslot == 0 || (slot = slotalloc()) < 0)
+    return -1;
+
+  acquiresleep(&swapper.lock);
+  if((pa = swapvictim(slot)) == 0){
+    releasesleep(&swapper.lock);
+    acquire(&swap.lock);
+    swap.ref[slot] = 0;
+    swap.busy[slot] = 0;
+    release(&swap.lock);
+    return -1;
+  }
+  releasesleep(&swapper.lock);
+  swaprw(slot, (char*)pa, 1);
+
+  acquire(&swap.lock);
+  swap.busy[slot] = 0;
+  wakeup(&swap.busy[slot]);
+  release(&swap.lock);
+  kfree((void*)pa);
+  return 0;
+}
+
+// read back the page that pte, for va in pagetable, says
+// is in swap, and map it again.
+// returns the physical address, or 0.
+uint64
+swapin(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 slot = PTE2SLOT(*pte);
+  char *mem;
+
+  // can't wait for the disk while holding a spinlock.
+  if(holdingany())
+    return 0;
+  if((mem = ualloc()) == 0)
+    return 0;
+
+  acquire(&swap.lock);
+  while(swap.busy[slot])
+    sleep(&swap.busy[slot], &swap.lock);
+  release(&swap.lock);
+
+  swaprw(slot, mem, 0);
+
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_A) | PTE_V;
+  uvmflush(pagetable, va);
+  swapfree(slot);
+  return (uint64)mem;
+}
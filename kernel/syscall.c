@@ -107,6 +107,12 @@ extern uint64 sys_getswapcount(void);
 extern uint64 sys_nice(void);
 extern uint64 sys_startcfs(void);
 extern uint64 sys_stopcfs(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shm_open(void);
+extern uint64 sys_shm_attach(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_bcachestat(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -137,7 +143,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_getswapcount] sys_getswapcount,
 [SYS_nice] sys_nice,
 [SYS_startcfs] sys_startcfs,
-[SYS_stopcfs] sys_stopcfs
+[SYS_stopcfs] sys_stopcfs,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shm_open]   sys_shm_open,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_spawn]   sys_spawn,
+[SYS_bcachestat] sys_bcachestat,
 };
 
 void
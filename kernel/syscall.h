@@ -27,4 +27,10 @@
 // cfs helper syscalls
 #define SYS_nice 25
 #define SYS_startcfs 26
-#define SYS_stopcfs 27
\ No newline at end of file
+#define SYS_stopcfs 27
+#define SYS_mmap   28
+#define SYS_munmap 29
+#define SYS_shm_open   30
+#define SYS_shm_attach 31
+#define SYS_spawn  32
+#define SYS_bcachestat 33
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "bcstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -341,6 +342,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program is paged in from its file.
+  if(ip->type == T_FILE && (omode & (O_WRONLY|O_RDWR|O_TRUNC)) && itextbusy(ip)){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -431,20 +439,25 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// copy the user's argument vector at uargv into pages
+// in argv[MAXARG], for exec() and spawn().
+// returns 0, or -1 with nothing left allocated.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -460,18 +473,56 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = exec(myproc(), path, argv);
 
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact acts[NSPAWNACT];
+  uint64 uargv, uacts;
+  int nact, ret;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uacts);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nact < 0 || nact > NSPAWNACT)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)acts, uacts, nact*sizeof(acts[0])) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  ret = spawn(path, argv, acts, nact);
+
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -503,3 +554,98 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off, share;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  // addr is only a hint, and ignored.
+  share = flags & (MAP_SHARED|MAP_PRIVATE);
+  if(share != MAP_SHARED && share != MAP_PRIVATE)
+    return -1;
+  if(off < 0 || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || !f->readable)
+      return -1;
+    if(f->type != FD_INODE && (f->type != FD_SHM || share != MAP_SHARED))
+      return -1;
+    // a shared writable mapping writes back to the file.
+    if(share == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+  return mmap(len, prot, share, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(myproc(), addr, PGROUNDUP(len));
+}
+
+// open the shared-memory object called name, creating
+// it with size bytes if it doesn't exist.
+uint64
+sys_shm_open(void)
+{
+  char name[SHMNAME];
+  uint64 size;
+  struct shm *s;
+  struct file *f;
+  int fd;
+
+  if(argstr(0, name, SHMNAME) < 0)
+    return -1;
+  argaddr(1, &size);
+  if((s = shmget(name, size)) == 0)
+    return -1;
+  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
+    if(f)
+      fileclose(f);
+    shmput(s);
+    return -1;
+  }
+  f->type = FD_SHM;
+  f->shm = s;
+  f->readable = 1;
+  f->writable = 1;
+  return fd;
+}
+
+// map all of the shared-memory object open as fd.
+uint64
+sys_shm_attach(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_SHM)
+    return -1;
+  return mmap(shmsize(f->shm), PROT_READ|PROT_WRITE, MAP_SHARED, f, 0);
+}
+
+// copy the buffer cache's statistics to the user's
+// struct bcstat.
+uint64
+sys_bcachestat(void)
+{
+  uint64 addr;
+  struct bcstat st;
+
+  argaddr(0, &addr);
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char uaccess_begin[], uaccess_end[], uaccess_fault[]; // uaccess.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -67,6 +68,10 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15) != 0){
+    // page fault on a lazily-allocated, not yet loaded,
+    // or copy-on-write page.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,9 +81,14 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt. the
+  // kernel is done with the process for now, so swapout()
+  // may page its memory out while it waits.
+  if(which_dev == 2){
+    p->inuser = 1;
     yield();
+    p->inuser = 0;
+  }
 
   usertrapret();
 }
@@ -91,6 +101,9 @@ usertrapret(void)
 {
   struct proc *p = myproc();
 
+  // the system call, if any, is done with user memory.
+  p->pinlen = 0;
+
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
@@ -120,7 +133,8 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // the scheduler's kvmswitch() gave it an ASID.
+  uint64 satp = MAKE_SATP(p->pagetable, p->asid);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -144,7 +158,21 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // don't let whatever runs next touch user memory by
+  // accident; the w_sstatus() below restores SUM.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) && sepc >= (uint64)uaccess_begin &&
+     sepc < (uint64)uaccess_end){
+    // a page fault in copyin() or copyout()'s access to user
+    // memory through USERALIAS. fill in the page and retry,
+    // or make the copy fail.
+    struct proc *p = myproc();
+    uint64 va = r_stval();
+    if(p == 0 || va < USERALIAS ||
+       vmfault(p->pagetable, va - USERALIAS, scause == 15) == 0)
+      sepc = (uint64)uaccess_fault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
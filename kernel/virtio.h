@@ -46,8 +46,13 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two. each request takes two plus one
+// per block; readahead keeps several requests in flight,
+// and the log keeps several of up to MAXSEG blocks each.
+#define NUM 128
+
+// most blocks in one request.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -46,7 +46,8 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // b->disk is set until it's done,
+    int *busy;       // or else *busy is
     char status;
   } info[NUM];
 
@@ -196,12 +197,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +212,35 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// start one request that reads or writes the n blocks from
+// blockno on, to or from data[0..n-1], and return without
+// waiting for the disk. it sets b->disk, or if b is 0 *busy,
+// and clears it when done. the data must stay put until
+// then: for bufs, locked, or for a readahead (b->async)
+// referenced.
+static void
+virtio_disk_startv(struct buf *b, int *busy, char **data, int n, uint blockno, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = (uint64)blockno * (BSIZE / 512);
+  int idx[MAXSEG + 2];
+
+  if(n < 1 || n > MAXSEG)
+    panic("virtio_disk_startv");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
+  // a descriptor for type/reserved/sector, then the data,
+  // here one descriptor per buf, then one for a 1-byte
+  // status result.
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +257,31 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    struct virtq_desc *d = &disk.desc[idx[1+i]];
+    d->addr = (uint64) data[i];
+    d->len = BSIZE;
+    if(write)
+      d->flags = 0; // device reads b->data
+    else
+      d->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d->flags |= VRING_DESC_F_NEXT;
+    d->next = idx[2+i];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
+  if(b)
+    b->disk = 1;
+  else
+    *busy = 1;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].busy = busy;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -280,14 +295,82 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
+  release(&disk.vdisk_lock);
+}
+
+// start reading or writing b, and return without waiting for
+// the disk; virtio_disk_wait() waits. b must stay locked, or
+// for a readahead (b->async) referenced, until the disk is done.
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  char *data = (char*)b->data;
+
+  virtio_disk_startv(b, 0, &data, 1, b->blockno, write);
+}
+
+// write the data of the n bufs b[0..n-1], each to block
+// blockno[i], or to its own block if blockno is 0, and wait.
+// a run of consecutive blocks goes in one request, up to
+// MAXSEG of them, and all the requests are under way at
+// once. the bufs must be locked.
+void
+virtio_disk_writev(struct buf **b, uint *blockno, int n)
+{
+  char *data[MAXSEG];
+  int i, k;
+
+  for(i = 0; i < n; i += k){
+    uint bn = blockno ? blockno[i] : b[i]->blockno;
+    data[0] = (char*)b[i]->data;
+    for(k = 1; i + k < n && k < MAXSEG; k++){
+      uint next = blockno ? blockno[i+k] : b[i+k]->blockno;
+      if(next != bn + k)
+        break;
+      data[k] = (char*)b[i+k]->data;
+    }
+    virtio_disk_startv(b[i], 0, data, k, bn, 1);
+  }
+  // only the first buf of each request is marked b->disk.
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(b[i]);
+}
+
+// wait for the disk to finish with b, if it has b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
 
+// read or write the n blocks from blockno on, to or from
+// data, in one request, and wait. for I/O that bypasses
+// the buffer cache; data must be in the kernel's direct
+// map of RAM, not on a kernel stack.
+void
+virtio_disk_rwmem(uint blockno, char *data, int n, int write)
+{
+  char *d[MAXSEG];
+  int busy;
+
+  for(int i = 0; i < n; i++)
+    d[i] = data + i*BSIZE;
+  virtio_disk_startv(0, &busy, d, n, blockno, write);
+  acquire(&disk.vdisk_lock);
+  while(busy)
+    sleep(&busy, &disk.vdisk_lock);
   release(&disk.vdisk_lock);
 }
 
@@ -317,8 +400,23 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    int *busy = disk.info[id].busy;
+    disk.info[id].b = 0;
+    disk.info[id].busy = 0;
+    free_chain(id);
+    if(b == 0){
+      *busy = 0;
+      wakeup(busy);
+    } else {
+      b->disk = 0;   // disk is done with buf
+      if(b->async){
+        // a readahead that no one is waiting for yet.
+        b->valid = 1;
+        b->async = 0;
+        bunpin(b);
+      }
+      wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
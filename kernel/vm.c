@@ -3,14 +3,24 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// address-space IDs; see kvmswitch().
+uint64 asidmax; // largest ASID; 0 if the hardware has none
+static struct spinlock asid_lock;
+static uint64 asidgen = 1;
+static uint64 nextasid = 1; // 0 is the kernel's
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -37,6 +47,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages for most of it.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -54,6 +65,7 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asid_lock, "asid");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,12 +76,157 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // find out how many ASIDs the hardware has, by writing
+  // all ones to the ASID field and reading back what stuck.
+  if(cpuid() == 0){
+    w_satp(MAKE_SATP(kernel_pagetable, SATP_ASIDMAX));
+    asidmax = (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMAX;
+  }
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Per-process kernel page tables.
+//
+// each process runs in the kernel on its own page table,
+// p->kpagetable, whose lower half is the kernel's and whose
+// upper half, from USERALIAS up, shares the level-1 pages of
+// the process's user page table. so the kernel sees user
+// address va at USERALIAS+va, and copyin() and copyout() can
+// use plain loads and stores instead of walking the page
+// table a page at a time. the upper half only holds copies of
+// the user root PTEs; uvmflush() and kvmsync() keep them up
+// to date.
+//
+// Address-space IDs.
+//
+// each process gets a pair of ASIDs, one for its user page
+// table and the next for its kernel page table, so that the
+// TLB can hold entries for several address spaces and
+// neither traps nor context switches need flush it. ASIDs are
+// handed out in order; when they run out a new generation
+// starts, and every hart flushes its whole TLB before it runs
+// a process with ASIDs from the new one. so an ASID is never
+// reused within a generation.
+//
+// a process's ASIDs may have stale entries on a hart other
+// than the one that changed its page table; kvmswitch()
+// flushes them when the process next runs there.
+
+// Make a page table for a process to run in the kernel:
+// the kernel's mappings, and no user memory yet.
+pagetable_t
+kvmcreate(void)
+{
+  pagetable_t kpgtbl;
+
+  if((kpgtbl = (pagetable_t) kalloc()) == 0)
+    return 0;
+  memset(kpgtbl, 0, PGSIZE);
+  for(int i = 0; i < 256; i++)
+    kpgtbl[i] = kernel_pagetable[i];
+  return kpgtbl;
+}
+
+// Free a process's kernel page table. Only the root page is
+// its own; the rest belong to the kernel's or the user's.
+void
+kvmfree(pagetable_t kpgtbl)
+{
+  kfree((void*)kpgtbl);
+}
+
+// Point p's user alias at p->pagetable, after fork() or
+// exec() built a new one. If p is running, flush its old
+// page table from this hart's TLB.
+void
+kvmsync(struct proc *p)
+{
+  for(int i = 0; i < 256; i++)
+    p->kpagetable[256 + i] = p->pagetable[i];
+  if(p != myproc())
+    return;
+  if(asidmax == 0){
+    sfence_vma();
+  } else {
+    sfence_vma_asid(p->asid);
+    sfence_vma_asid(p->asid + 1);
+  }
+}
+
+// Switch this hart to p's kernel page table, first giving p
+// ASIDs and flushing stale TLB entries. If p is 0, switch
+// back to the kernel's page table.
+// Called by the scheduler with interrupts off.
+void
+kvmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(p == 0){
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+    if(asidmax == 0)
+      sfence_vma();
+    return;
+  }
+
+  if(asidmax == 0){
+    // no ASIDs: every switch flushes the whole TLB.
+    w_satp(MAKE_SATP(p->kpagetable, 0));
+    sfence_vma();
+    return;
+  }
+
+  gen = __atomic_load_n(&asidgen, __ATOMIC_ACQUIRE);
+  if(p->asidgen != gen){
+    acquire(&asid_lock);
+    if(nextasid + 1 > asidmax){
+      __atomic_store_n(&asidgen, asidgen + 1, __ATOMIC_RELEASE);
+      nextasid = 1;
+    }
+    p->asid = nextasid;
+    nextasid += 2;
+    p->asidgen = gen = asidgen;
+    release(&asid_lock);
+    // no TLB flushed for this generation has entries for them.
+    p->tlbcpu = cpuid();
+  }
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->tlbcpu != cpuid()){
+    sfence_vma_asid(p->asid);
+    sfence_vma_asid(p->asid + 1);
+  }
+  p->tlbcpu = cpuid();
+  w_satp(MAKE_SATP(p->kpagetable, p->asid + 1));
+}
+
+// The PTE for va in pagetable has changed. If pagetable
+// is the current process's, update its user alias and
+// flush va from this hart's TLB.
+void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  // a new level-1 page may have been added.
+  p->kpagetable[256 + PX(2, va)] = pagetable[PX(2, va)];
+  if(asidmax == 0){
+    sfence_vma();
+  } else {
+    sfence_vma_page(va, p->asid);
+    sfence_vma_page(USERALIAS + va, p->asid + 1);
+  }
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,6 +239,9 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a 2MB megapage, returns the level-1 PTE
+// that maps it, which has PTE_SUPER set; see pteaddr().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -90,7 +250,9 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
+    if(*pte & PTE_SUPER) {
+      return pte;
+    } else if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -102,6 +264,34 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE for va, which
+// maps either a megapage or a level-0 page-table page.
+static pte_t *
+walk1(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      return 0;
+    memset(pagetable, 0, PGSIZE);
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// The physical address of the page containing va,
+// given the PTE that walk() returned for it.
+uint64
+pteaddr(pte_t pte, uint64 va)
+{
+  if(pte & PTE_SUPER)
+    return PTE2PA(pte) + PGROUNDDOWN(va % SUPERPGSIZE);
+  return PTE2PA(pte);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -121,7 +311,7 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, va);
   return pa;
 }
 
@@ -137,7 +327,9 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Where va and pa are both 2MB-aligned, and
+// at least 2MB remain, uses a megapage if nothing is mapped
+// there yet. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
@@ -151,11 +343,26 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      if((pte = walk1(pagetable, a, 1)) == 0)
+        return -1;
+      if((*pte & PTE_V) == 0){
+        *pte = PA2PTE(pa) | perm | PTE_SUPER | PTE_V;
+        uvmflush(pagetable, a);
+        if(last - a == SUPERPGSIZE - PGSIZE)
+          break;
+        a += SUPERPGSIZE;
+        pa += SUPERPGSIZE;
+        continue;
+      }
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
+    uvmflush(pagetable, a);
     if(a == last)
       break;
     a += PGSIZE;
@@ -164,8 +371,34 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Break the megapage containing va into 512 pages, so that
+// they can be unmapped or shared one at a time. Does nothing
+// if va isn't in a megapage. Returns -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  int flags;
+
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_SUPER) == 0)
+    return 0;
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_SUPER;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  uvmflush(pagetable, va);
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned, and the range must not cover only part of
+// a megapage. Pages that were never faulted in (see
+// vmfault()) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -178,16 +411,36 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if((*pte & PTE_V) == 0){
+      if(*pte & PTE_SWAP){
+        if(do_free)
+          swapfree(PTE2SLOT(*pte));
+        *pte = 0;
+      }
+      continue;
+    }
+    if(*pte & PTE_SUPER){
+      if(a % SUPERPGSIZE == 0 && va + npages*PGSIZE - a >= SUPERPGSIZE){
+        // the whole megapage goes.
+        uint64 pa = PTE2PA(*pte);
+        *pte = 0;
+        uvmflush(pagetable, a);
+        if(do_free)
+          superfree((void*)pa);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // the caller should have split it.
+      panic("uvmunmap: part of a megapage");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    uint64 pa = PTE2PA(*pte);
     *pte = 0;
+    uvmflush(pagetable, a);
+    if(do_free)
+      kfree((void*)pa);
   }
 }
 
@@ -220,6 +473,54 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
   memmove(mem, src, sz);
 }
 
+// Allocate a page for user memory. If memory is short, page
+// something out to make room, unless the caller holds a
+// spinlock and so can't wait for the disk.
+void *
+ualloc(void)
+{
+  void *pa;
+
+  while((pa = kalloc()) == 0){
+    if(holdingany() || swapout() < 0)
+      return 0;
+  }
+  return pa;
+}
+
+// Count the pages of user memory in pagetable that are
+// resident and in swap.
+void
+uvmcount(pagetable_t pagetable, int *rss, int *swapped)
+{
+  pagetable_t l1, l0;
+  pte_t pte;
+
+  *rss = *swapped = 0;
+  for(int i = 0; i < 512; i++){
+    if((pagetable[i] & PTE_V) == 0)
+      continue;
+    l1 = (pagetable_t)PTE2PA(pagetable[i]);
+    for(int j = 0; j < 512; j++){
+      if((l1[j] & PTE_V) == 0)
+        continue;
+      if(l1[j] & PTE_SUPER){
+        if(l1[j] & PTE_U)
+          *rss += SUPERPGSIZE / PGSIZE;
+        continue;
+      }
+      l0 = (pagetable_t)PTE2PA(l1[j]);
+      for(int k = 0; k < 512; k++){
+        pte = l0[k];
+        if((pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U))
+          (*rss)++;
+        else if((pte & PTE_V) == 0 && (pte & PTE_SWAP))
+          (*swapped)++;
+      }
+    }
+  }
+}
+
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 uint64
@@ -233,7 +534,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = ualloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -251,7 +552,9 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz with
+// nothing freed if newsz falls in a megapage and there's no
+// memory to split it.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -260,6 +563,11 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
+    // a megapage sz ends in is wholly below sz, so only
+    // one that newsz cuts into needs splitting.
+    if(PGROUNDUP(newsz) % SUPERPGSIZE != 0 &&
+       uvmsplit(pagetable, PGROUNDUP(newsz)) < 0)
+      return oldsz;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
 
@@ -298,40 +606,305 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Shares the physical pages rather than copying them:
+// writable pages become read-only and copy-on-write in
+// both page tables, and uvmcow() copies a page when one
+// side first writes it.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of old in [start, end) into new at the same
+// addresses. If cow, writable pages become copy-on-write,
+// as for uvmcopy(); otherwise both page tables share them
+// as they are, for MAP_SHARED mappings.
+// returns 0 on success, -1 on failure.
+// unmaps any pages it mapped on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // not yet faulted in; the child will fault too
+    if((*pte & PTE_V) == 0){
+      if(*pte & PTE_SWAP){
+        // the child reads its own copy back from the same slot.
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        *npte = *pte;
+        swapdup(PTE2SLOT(*pte));
+      }
+      continue;
+    }
+    if(*pte & PTE_SUPER){
+      // share page by page, so each can be copied on its own.
+      if(uvmsplit(old, i) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(cow && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmflush(old, i);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Handle a write to the copy-on-write page at va:
+// give this page table a private, writable copy,
+// or just make the page writable if no one else
+// shares it any more.
+// returns 0 on success, -1 if va isn't a copy-on-write
+// user page or there's no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return 0;
+  }
+
+  // hold a reference, so that the page can't be paged
+  // out if ualloc() has to make room.
+  kdup((void*)pa);
+  if((mem = ualloc()) == 0){
+    kfree((void*)pa);
+    return -1;
+  }
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmflush(pagetable, va);
+  kfree((void*)pa); // ours
+  kfree((void*)pa); // the PTE's
+  return 0;
+}
+
+// the program segment containing va, or 0.
+static struct seg*
+findseg(struct proc *p, uint64 va)
+{
+  struct seg *s;
+
+  if(p->execip == 0)
+    return 0;
+  for(s = p->segs; s < &p->segs[NSEG]; s++)
+    if(s->memsz && va >= s->va && va < s->va + s->memsz)
+      return s;
+  return 0;
+}
+
+// does the 2MB at base have most of its pages, in memory
+// or in swap?
+static int
+superdense(pagetable_t pagetable, uint64 base)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  int n = 0;
+
+  if((pte = walk1(pagetable, base, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if(*pte & PTE_SUPER)
+    return 1;
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(int i = 0; i < 512; i++)
+    if(pt[i] & (PTE_V|PTE_SWAP))
+      n++;
+  return n > 512/2;
+}
+
+// try to fault in the whole 2MB of heap around va as a
+// megapage. the 2MB must be part of a 2MB-aligned sbrk()
+// grow, hold no part of the program, and have nothing mapped
+// in it yet; and the 2MB below it must be mostly in use, so
+// that only a heap being filled densely gets megapages, not
+// one touched here and there.
+// returns the physical address of va's page, or 0.
+static uint64
+superfault(struct proc *p, uint64 va)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  pte_t *pte;
+  struct seg *s;
+  char *mem;
+
+  if(base < p->superlo || base + SUPERPGSIZE > p->superhi || base < SUPERPGSIZE)
+    return 0;
+  if(!superdense(p->pagetable, base - SUPERPGSIZE))
+    return 0;
+  if(p->execip){
+    for(s = p->segs; s < &p->segs[NSEG]; s++)
+      if(s->memsz && s->va < base + SUPERPGSIZE && base < s->va + s->memsz)
+        return 0;
+  }
+  if((pte = walk1(p->pagetable, base, 0)) != 0 && (*pte & PTE_V))
+    return 0;
+
+  if((mem = superalloc()) == 0)
+    return 0;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mappages(p->pagetable, base, SUPERPGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    superfree(mem);
+    return 0;
+  }
+  return (uint64)mem + (va - base);
+}
+
+// map the page cache's own copy of a read-only page of the
+// program, so that everyone running it shares one copy.
+// the page must start at a page boundary in the file, and
+// hold nothing past the segment but what lies past the end
+// of the file, which the cache fills with zeros.
+// returns the physical address, or 0 to read in a private copy.
+static uint64
+textfault(struct proc *p, struct seg *s, uint64 va)
+{
+  uint64 off = s->off + (va - s->va);
+  char *mem;
+
+  if((s->perm & PTE_W) || off % PGSIZE != 0)
+    return 0;
+  if(va + PGSIZE > s->va + s->filesz && s->off + s->filesz < p->execip->size)
+    return 0;
+  // no ilock: exec's itext() keeps the file from changing.
+  if((mem = pcget(p->execip, off / PGSIZE)) == 0)
+    return 0;
+  // the reference pcget() returned is the PTE's.
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, s->perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Handle a page fault at user address va in pagetable,
+// which must be the current process's page table:
+// allocate a zeroed page (or megapage) if va is part of the
+// heap that sbrk() grew without allocating, map or read in a page
+// of the program that exec() didn't load, or copy a copy-on-write
+// page on a write.
+// returns 0 if va isn't a page the process may fault in,
+// or there's no memory; otherwise the page's physical address.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  uint64 n;
+  int perm;
+
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && write && (*pte & PTE_COW)){
+    if(uvmcow(pagetable, va) == 0)
+      return pteaddr(*pte, va);
+    return 0;
+  }
+  if(pte && (*pte & PTE_SWAP))
+    return swapin(pagetable, va, pte);
+  if((v = vmalookup(p, va)) != 0)
+    return mmapfault(p, v, va, write);
+  if(pte && (*pte & PTE_V))
+    return 0;
+
+  if(va >= p->sz)
+    return 0;
+  s = findseg(p, va);
+  if(s == 0 && (n = superfault(p, va)) != 0)
+    return n;
+  if(s != 0 && (n = textfault(p, s, va)) != 0)
+    return n;
+  if((mem = ualloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  perm = PTE_W|PTE_R|PTE_U;
+  if(s != 0){
+    // part of the program: read it from the executable.
+    // no ilock: exec's itext() keeps the file from changing.
+    perm = s->perm;
+    if(va < s->va + s->filesz){
+      n = s->va + s->filesz - va;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(readi(p->execip, 0, (uint64)mem, s->off + (va - s->va), n) != n){
+        kfree(mem);
+        return 0;
+      }
+    }
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// fault in the pages of [va, va+len) that vmfault() would
+// have to read from a file or from swap, so that the caller can
+// then copy to or from them while holding a spinlock or a
+// buffer that the read might need.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  struct vma *v;
+  pte_t *pte;
+  uint64 a;
+
+  if(p == 0 || pagetable != p->pagetable || va + len < va || va + len > MAXVA)
+    return;
+  // keep swapout() away from it, too.
+  p->pinva = va;
+  p->pinlen = len;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if((pte && (*pte & PTE_SWAP)) ||
+       ((s = findseg(p, a)) != 0 && a < s->va + s->filesz) ||
+       ((v = vmalookup(p, a)) != 0 && v->f))
+      vmfault(pagetable, a, 0);
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -342,7 +915,34 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  // not PTE_W either, since the kernel can write
+  // non-PTE_U pages through USERALIAS.
+  *pte &= ~(PTE_U | PTE_W);
+  uvmflush(pagetable, va);
+}
+
+// Can [va, va+len) of pagetable be copied directly, through
+// the current process's USERALIAS?
+static int
+uaccessok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable &&
+         va + len >= va && va + len <= TRAPFRAME;
+}
+
+// let the kernel load and store to user pages.
+static void
+uaccess_on(void)
+{
+  w_sstatus(r_sstatus() | SSTATUS_SUM | SSTATUS_MXR);
+}
+
+static void
+uaccess_off(void)
+{
+  w_sstatus(r_sstatus() & ~(SSTATUS_SUM | SSTATUS_MXR));
 }
 
 // Copy from kernel to user.
@@ -352,12 +952,29 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
+  int r;
+
+  if(uaccessok(pagetable, dstva, len)){
+    uaccess_on();
+    r = ucopy((void*)(USERALIAS + dstva), src, len);
+    uaccess_off();
+    return r;
+  }
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
       return -1;
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      if(vmfault(pagetable, va0, 1) == 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W))
+      return -1;
+    pa0 = pteaddr(*pte, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -377,11 +994,19 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  int r;
+
+  if(uaccessok(pagetable, srcva, len)){
+    uaccess_on();
+    r = ucopy(dst, (void*)(USERALIAS + srcva), len);
+    uaccess_off();
+    return r;
+  }
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -404,11 +1029,19 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  int r;
+
+  if(uaccessok(pagetable, srcva, max)){
+    uaccess_on();
+    r = ucopystr(dst, (char*)(USERALIAS + srcva), max);
+    uaccess_off();
+    return r;
+  }
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -0,0 +1,81 @@
+// bcachestat: print buffer cache statistics, like vmstat.
+//
+//   bcachestat [interval [count]]
+//
+// the first line is totals since boot; each line after that
+// covers the interval before it, in clock ticks (about a
+// tenth of a second each; the default is 10). buffer counts
+// are as of the end of the interval.
+
+#include "kernel/types.h"
+#include "kernel/bcstat.h"
+#include "user/user.h"
+
+// print v right-aligned in a column w wide, since
+// printf() has no widths.
+void
+col(int v, int w)
+{
+  int n = 1;
+
+  for(int x = v; x >= 10 || x <= -10; x /= 10)
+    n++;
+  if(v < 0)
+    n++;
+  for(; n < w; n++)
+    printf(" ");
+  printf(" %d", v);
+}
+
+void
+header(void)
+{
+  printf("  bufs  busy   pin     hits   misses   evicts hit%%   waits  waitms\n");
+}
+
+void
+line(struct bcstat *st, struct bcstat *prev)
+{
+  int hits = st->hits - prev->hits;
+  int misses = st->misses - prev->misses;
+
+  col(st->nbuf, 5);
+  col(st->nbusy, 5);
+  col(st->npinned, 5);
+  col(hits, 8);
+  col(misses, 8);
+  col(st->evictions - prev->evictions, 8);
+  col(hits + misses ? hits * 100 / (hits + misses) : 0, 4);
+  col(st->waits - prev->waits, 7);
+  col((st->waitus - prev->waitus) / 1000, 7);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bcstat st, prev;
+  int interval = 10, count = -1;
+
+  if(argc > 1 && (interval = atoi(argv[1])) <= 0){
+    fprintf(2, "usage: bcachestat [interval [count]]\n");
+    exit(1);
+  }
+  if(argc > 2)
+    count = atoi(argv[2]);
+
+  memset(&prev, 0, sizeof(prev));
+  for(int n = 0; count < 0 || n < count; n++){
+    if(bcachestat(&st) < 0){
+      fprintf(2, "bcachestat: failed\n");
+      exit(1);
+    }
+    if(n % 20 == 0)
+      header();
+    line(&st, &prev);
+    prev = st;
+    if(count < 0 || n + 1 < count)
+      sleep(interval);
+  }
+  exit(0);
+}
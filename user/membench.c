@@ -0,0 +1,149 @@
+// membench: time operations that the kernel's memset(),
+// memmove() and user-copy routines dominate, to compare
+// kernels built different ways (e.g. with and without RVV=1).
+// times are in clock ticks, about a tenth of a second each.
+// "copy" times the copy routines alone: see copy().
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+#define MB (1024*1024)
+#define ROUNDS 64
+
+char buf[16*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+report(char *what, int mb, int ticks)
+{
+  if(ticks <= 0)
+    ticks = 1;
+  printf("%s: %d MB in %d ticks, %d MB/s\n", what, mb, ticks, mb * 10 / ticks);
+}
+
+// zero-filled pages, freshly allocated: kalloc() and
+// vmfault() memset() each one.
+void
+fill(void)
+{
+  char *a;
+  int t0;
+
+  t0 = uptime();
+  for(int r = 0; r < ROUNDS; r++){
+    a = mmap(0, MB, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == (char*)-1){
+      printf("membench: mmap failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < MB; i += PGSIZE)
+      a[i] = 1;
+    munmap(a, MB);
+  }
+  report("fill", ROUNDS, uptime() - t0);
+}
+
+// copy-on-write faults: the kernel memmove()s each page
+// the child writes to.
+void
+cow(void)
+{
+  char *a;
+  int t0, pid;
+
+  if((a = sbrk(MB)) == (char*)-1){
+    printf("membench: sbrk failed\n");
+    exit(1);
+  }
+  memset(a, 1, MB);
+  t0 = uptime();
+  for(int r = 0; r < ROUNDS / 4; r++){
+    if((pid = fork()) < 0){
+      printf("membench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(int i = 0; i < MB; i += PGSIZE)
+        a[i] = 2;
+      exit(0);
+    }
+    wait(0);
+  }
+  report("cow", ROUNDS / 4, uptime() - t0);
+  sbrk(-MB);
+}
+
+// reads of a cached file: copies out of the page cache
+// into user memory.
+void
+readfile(void)
+{
+  char *file = "membench.tmp";
+  int fd, t0;
+
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("membench: write failed\n");
+    exit(1);
+  }
+  close(fd);
+  t0 = uptime();
+  for(int r = 0; r < ROUNDS * (MB / sizeof(buf)); r++){
+    fd = open(file, O_RDONLY);
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("membench: read failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  report("read", ROUNDS, uptime() - t0);
+  unlink(file);
+}
+
+// the kernel's copy loop alone: big reads of a cached file
+// less the same number of 1-byte reads, which cost the same
+// system call, open(), close() and page-cache lookup but
+// copy next to nothing.
+void
+copy(void)
+{
+  char *file = "membench.tmp";
+  int fd, n, t0, big, small;
+
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("membench: write failed\n");
+    exit(1);
+  }
+  close(fd);
+  n = 4 * ROUNDS * (MB / sizeof(buf));
+  for(int pass = 0; pass < 2; pass++){
+    t0 = uptime();
+    for(int r = 0; r < n; r++){
+      fd = open(file, O_RDONLY);
+      if(read(fd, buf, pass ? 1 : sizeof(buf)) != (pass ? 1 : sizeof(buf))){
+        printf("membench: read failed\n");
+        exit(1);
+      }
+      close(fd);
+    }
+    if(pass == 0)
+      big = uptime() - t0;
+    else
+      small = uptime() - t0;
+  }
+  printf("copy: %d calls, %d ticks less %d for 1 byte\n", n, big, small);
+  report("copy", 4 * ROUNDS, big - small);
+  unlink(file);
+}
+
+int
+main(int argc, char *argv[])
+{
+  fill();
+  cow();
+  readfile();
+  copy();
+  exit(0);
+}
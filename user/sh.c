@@ -1,6 +1,7 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
 
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -131,6 +133,120 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Simple commands, with redirections, and pipelines of them
+// are started with spawn(), so the shell needn't fork a copy
+// of itself for each. Anything else goes to runcmd().
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// pipe descriptors the shell holds while it starts a
+// pipeline, which the commands mustn't inherit.
+int pfd[NOFILE];
+int npfd;
+
+void
+pfdclose(int fd)
+{
+  close(fd);
+  for(int i = 0; i < npfd; i++){
+    if(pfd[i] == fd){
+      pfd[i] = pfd[--npfd];
+      break;
+    }
+  }
+}
+
+struct spawnact acts[NSPAWNACT];
+int nact;
+
+void
+addact(int op, int fd, int newfd)
+{
+  // too many makes spawn() fail.
+  if(nact < NSPAWNACT){
+    acts[nact].op = op;
+    acts[nact].fd = fd;
+    acts[nact].newfd = newfd;
+  }
+  nact++;
+}
+
+// Start cmd, which spawnable() accepted, reading from in
+// and writing to out. closes in, if it isn't 0.
+// Returns the number of processes started.
+int
+spawncmd(struct cmd *cmd, int in, int out)
+{
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  int p[2], fds[MAXARGS], nfd, i, n;
+
+  if(cmd->type == PIPE){
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0){
+      fprintf(2, "pipe failed\n");
+      if(in != 0)
+        pfdclose(in);
+      return 0;
+    }
+    pfd[npfd++] = p[0];
+    pfd[npfd++] = p[1];
+    n = spawncmd(pcmd->left, in, p[1]);
+    pfdclose(p[1]);
+    return n + spawncmd(pcmd->right, p[0], out);
+  }
+
+  nact = 0;
+  if(in != 0)
+    addact(SPAWN_DUP2, in, 0);
+  if(out != 1)
+    addact(SPAWN_DUP2, out, 1);
+  // outermost redirection first, as runcmd() does them.
+  nfd = 0;
+  n = 1;
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if(nfd >= MAXARGS || (fds[nfd] = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      n = 0;
+      break;
+    }
+    addact(SPAWN_DUP2, fds[nfd], rcmd->fd);
+    addact(SPAWN_CLOSE, fds[nfd], 0);
+    nfd++;
+  }
+  for(i = 0; i < npfd; i++)
+    addact(SPAWN_CLOSE, pfd[i], 0);
+
+  if(n){
+    ecmd = (struct execcmd*)cmd;
+    if(spawn(ecmd->argv[0], ecmd->argv, acts, nact) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      n = 0;
+    }
+  }
+  for(i = 0; i < nfd; i++)
+    close(fds[i]);
+  if(in != 0)
+    pfdclose(in);
+  return n;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +262,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,9 +282,17 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd)){
+      for(n = spawncmd(cmd, 0, 1); n > 0; n--)
+        wait(0);
+    } else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -325,18 +450,36 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// the shell parses commands itself now, rather than in a
+// forked child, so a syntax error mustn't exit.
+int parseerr;
+
+void
+syntax(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
+// returns 0 after a syntax error.
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -380,8 +523,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -406,8 +551,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -432,13 +579,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS-1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -492,3 +643,28 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd*)cmd)->left);
+    freecmd(((struct listcmd*)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -1,4 +1,6 @@
 struct stat;
+struct spawnact;
+struct bcstat;
 
 // system calls
 int fork(void);
@@ -30,6 +32,12 @@ int getswapcount(void);
 int nice(int new_nice);
 int startcfs(void);
 int stopcfs(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int shm_open(const char*, uint);
+void* shm_attach(int);
+int spawn(const char*, char**, struct spawnact*, int);
+int bcachestat(struct bcstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
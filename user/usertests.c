@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/bcstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2571,6 +2572,530 @@ badarg(char *s)
   exit(0);
 }
 
+// fork a process that holds more than a third of memory a few
+// times at once. without copy-on-write the children can't all fit.
+// children that write must see private copies, and so
+// must the parent.
+void
+cowfork(char *s)
+{
+  enum { SZ = 48*1024*1024, NCHILD = 3 };
+  char *a;
+  int i, pid, xstatus;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    a[i] = i / PGSIZE;
+
+  for(int c = 0; c < NCHILD; c++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(i = 0; i < SZ; i += PGSIZE){
+        if(a[i] != (char)(i / PGSIZE)){
+          printf("%s: child read wrong value\n", s);
+          exit(1);
+        }
+      }
+      // write a few pages; these must be copied.
+      for(i = 0; i < SZ; i += SZ / 8)
+        a[i] = 'c' + c;
+      exit(0);
+    }
+  }
+  for(int c = 0; c < NCHILD; c++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(i = 0; i < SZ; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+  exit(0);
+}
+
+// sbrk() only reserves address space; a huge, sparsely
+// used heap should cost just the pages that are touched.
+void
+lazysbrk(char *s)
+{
+  enum { HUGE = 1024*1024*1024 };
+  char *a;
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of a sparse heap failed\n", s);
+    exit(1);
+  }
+  for(uint64 i = 0; i < HUGE; i += HUGE / 16){
+    if(a[i] != 0){
+      printf("%s: untouched heap not zero\n", s);
+      exit(1);
+    }
+    a[i] = 1;
+  }
+  a[HUGE-1] = 1;
+  if(sbrk(-HUGE) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// exec() pages a program in from its file on demand, so the
+// file can't change while the program runs, and reads into
+// not-yet-loaded data pages must work.
+static char pagedin[2*4096] = { 1 };
+
+void
+exectext(char *s)
+{
+  int fd, fds[2];
+
+  if((fd = open("usertests", O_RDWR)) >= 0){
+    printf("%s: opened a running program for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, pagedin, 4096) != 4096 || pagedin[1] != 'E'){
+    printf("%s: read into data segment failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "paged", 6) != 6 || read(fds[0], pagedin + 4096, 6) != 6 ||
+     strcmp(pagedin + 4096, "paged") != 0){
+    printf("%s: pipe read into data segment failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// mmap() of a file, privately and shared, and of anonymous
+// memory shared with a child.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*4096 + 100 };
+  char *buf, *a;
+  int fd, i, pid, xstatus;
+
+  buf = malloc(SZ);
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(memcmp(a, buf, SZ) != 0 || a[SZ] != 0 || a[3*4096-1] != 0){
+    printf("%s: mapped file has wrong contents\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  if(munmap(a, 3*4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != buf[0]){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  a[1] = 'Y';
+  a[4096 + 1] = 'Z';
+  // drop the middle page first, then the rest.
+  if(munmap(a + 4096, 4096) != 0 || munmap(a, 4096) != 0 ||
+     munmap(a + 2*4096, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, SZ) != SZ || buf[1] != 'Y' || buf[4096 + 1] != 'Z'){
+    printf("%s: shared write not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[100] = 42;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[100] != 42){
+    printf("%s: child's write to a shared mapping not seen\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a named shared-memory object, opened by name in two
+// processes, carries data between them.
+void
+shmtest(char *s)
+{
+  enum { SZ = 1024*1024 };
+  int fd, pid, xstatus;
+  char *a;
+
+  if((fd = shm_open("shmtest", SZ)) < 0 || (a = shm_attach(fd)) == (char*)-1){
+    printf("%s: shm_open/shm_attach failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    char *b;
+    close(fd);
+    munmap(a, SZ);
+    if((fd = shm_open("shmtest", SZ)) < 0 || (b = shm_attach(fd)) == (char*)-1)
+      exit(1);
+    close(fd);
+    for(int i = 0; i < SZ; i += 4096)
+      b[i] = i / 4096;
+    exit(0);
+  }
+  close(fd);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed to attach\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: shared memory has wrong contents\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// a big heap is mapped with 2MB megapages; they must
+// survive fork() and a shrink that splits one.
+void
+superpg(char *s)
+{
+  enum { SZ = 6*1024*1024 };
+  char *a;
+  int pid, xstatus;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += 4096)
+    a[i] = i / 4096;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < SZ; i += 4096){
+      if(a[i] != (char)(i / 4096))
+        exit(1);
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap contents\n", s);
+    exit(1);
+  }
+  // cut into the middle of a megapage.
+  if(sbrk(-(SZ/2 + 4096)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ/2 - 4096; i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: heap changed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// the kernel copies to and from user memory directly; a copy
+// must fill in lazy pages, break COW, and fail on text.
+char uabuf[8192];
+
+void
+uaccess(char *s)
+{
+  char *file = "uaccess.tmp";
+  char *a;
+  int fd, pid, xstatus;
+
+  for(int i = 0; i < sizeof(uabuf); i++)
+    uabuf[i] = i * 7;
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, uabuf + 1, sizeof(uabuf) - 1) != sizeof(uabuf) - 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // into not-yet-allocated heap, unaligned.
+  a = sbrk(3*4096);
+  fd = open(file, O_RDONLY);
+  if(read(fd, a + 3, sizeof(uabuf) - 1) != sizeof(uabuf) - 1){
+    printf("%s: read into lazy heap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(int i = 1; i < sizeof(uabuf); i++){
+    if(a[i + 2] != uabuf[i]){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  // into a copy-on-write page.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    fd = open(file, O_RDONLY);
+    if(read(fd, uabuf, 100) != 100)
+      exit(1);
+    exit(uabuf[0] == 7 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || uabuf[0] != 0 || uabuf[1] != 7){
+    printf("%s: copy-on-write read failed\n", s);
+    exit(1);
+  }
+
+  // text is read-only.
+  fd = open(file, O_RDONLY);
+  if(read(fd, (char*)uaccess, 16) != -1){
+    printf("%s: read into text succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+}
+
+// file data is cached in pages; reads must see writes that
+// land in cached pages, extensions, and truncations.
+char pcbuf[3*4096];
+char pcgot[6000];
+
+void
+pcache(char *s)
+{
+  char *file = "pcache.tmp";
+  char c;
+  int fd;
+
+  for(int i = 0; i < sizeof(pcbuf); i++)
+    pcbuf[i] = 'a' + i % 23;
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, pcbuf, 5000) != 5000){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read it in, then overwrite across the page boundary.
+  fd = open(file, O_RDONLY);
+  if(read(fd, pcgot, 5000) != 5000 || memcmp(pcbuf, pcgot, 5000) != 0){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(file, O_RDWR);
+  for(int i = 0; i < 4000; i++){
+    if(read(fd, &c, 1) != 1){
+      printf("%s: seek failed\n", s);
+      exit(1);
+    }
+  }
+  if(write(fd, "0123456789abcdefghij", 20) != 20){
+    printf("%s: overwrite failed\n", s);
+    exit(1);
+  }
+  // and extend it.
+  for(int i = 4020; i < 5000; i++)
+    read(fd, &c, 1);
+  if(write(fd, "XYZ", 3) != 3){
+    printf("%s: append failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memmove(pcbuf + 4000, "0123456789abcdefghij", 20);
+  memmove(pcbuf + 5000, "XYZ", 3);
+
+  fd = open(file, O_RDONLY);
+  if(read(fd, pcgot, sizeof(pcgot)) != 5003){
+    printf("%s: wrong size after writes\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(memcmp(pcbuf, pcgot, 5003) != 0){
+    printf("%s: stale data after writes\n", s);
+    exit(1);
+  }
+
+  // truncate and write something shorter.
+  fd = open(file, O_RDWR|O_TRUNC);
+  if(fd < 0 || write(fd, "hello", 5) != 5){
+    printf("%s: truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(file, O_RDONLY);
+  if(read(fd, pcbuf, sizeof(pcbuf)) != 5 || memcmp(pcbuf, "hello", 5) != 0){
+    printf("%s: stale data after truncate\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+}
+
+// spawn() starts a program without fork(), with the file
+// actions applied to the child's copy of our open files.
+void
+spawntest(char *s)
+{
+  char *argv[] = { "echo", "spawned", 0 };
+  struct spawnact acts[3];
+  char buf[32];
+  int p[2], pid, xstatus, n, tot;
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  acts[0].op = SPAWN_DUP2;
+  acts[0].fd = p[1];
+  acts[0].newfd = 1;
+  acts[1].op = SPAWN_CLOSE;
+  acts[1].fd = p[0];
+  acts[2].op = SPAWN_CLOSE;
+  acts[2].fd = p[1];
+  if((pid = spawn("echo", argv, acts, 3)) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(p[1]);
+  tot = 0;
+  while((n = read(p[0], buf + tot, sizeof(buf) - 1 - tot)) > 0)
+    tot += n;
+  close(p[0]);
+  buf[tot] = 0;
+  if(strcmp(buf, "spawned\n") != 0){
+    printf("%s: wrong output %s\n", s, buf);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", argv, 0, 0) >= 0){
+    printf("%s: spawned a missing program\n", s);
+    exit(1);
+  }
+  acts[0].fd = NOFILE;
+  if(spawn("echo", argv, acts, 1) >= 0){
+    printf("%s: spawned with a bad action\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// the buffer cache statistics should count the lookups
+// that creating a file makes.
+void
+bcachestattest(char *s)
+{
+  struct bcstat a, b;
+  int fd;
+
+  if(bcachestat(&a) < 0){
+    printf("%s: bcachestat failed\n", s);
+    exit(1);
+  }
+  if(a.nbuf <= 0 || a.nbusy > a.nbuf || a.npinned > a.nbusy){
+    printf("%s: bad buffer counts %d %d %d\n", s, a.nbuf, a.nbusy, a.npinned);
+    exit(1);
+  }
+  if((fd = open("bcstat.tmp", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("bcstat.tmp");
+  if(bcachestat(&b) < 0){
+    printf("%s: bcachestat failed\n", s);
+    exit(1);
+  }
+  if(b.hits + b.misses <= a.hits + a.misses || b.evictions < a.evictions ||
+     b.waits < a.waits){
+    printf("%s: counts didn't go up\n", s);
+    exit(1);
+  }
+  if(bcachestat((struct bcstat*)0xffffffffffffL) != -1){
+    printf("%s: bcachestat to a bad address worked\n", s);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3160,16 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {exectext, "exectext"},
+  {mmaptest, "mmap"},
+  {shmtest, "shm"},
+  {superpg, "superpg"},
+  {uaccess, "uaccess"},
+  {pcache, "pcache"},
+  {spawntest, "spawn"},
+  {bcachestattest, "bcachestat"},
 
   { 0, 0},
 };
@@ -2924,6 +3459,66 @@ outofinodes(char *s)
   }
 }
 
+// a process's memory is paged out to swap when another
+// runs the machine out of RAM, and comes back intact.
+void
+swaptest(char *s)
+{
+  enum { SZ = 4*1024*1024 };
+  int ready[2], go[2], pid, hog, xstatus;
+  char *a, c;
+
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // mmap(), since a big heap would get megapages, which
+    // aren't paged out.
+    a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == (char*)0xffffffffffffffffL)
+      exit(1);
+    for(int i = 0; i < SZ; i += 4096)
+      a[i] = i / 4096 + 1;
+    write(ready[1], "x", 1);
+    read(go[0], &c, 1);
+    for(int i = 0; i < SZ; i += 4096)
+      if(a[i] != (char)(i / 4096 + 1))
+        exit(1);
+    exit(0);
+  }
+  read(ready[0], &c, 1);
+
+  // use up all memory, until the kernel kills the hog.
+  hog = fork();
+  if(hog < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(hog == 0){
+    while(1){
+      a = sbrk(1024*1024);
+      if(a == (char*)0xffffffffffffffffL)
+        exit(0);
+      for(int i = 0; i < 1024*1024; i += 4096)
+        a[i] = 1;
+    }
+  }
+  wait(0);
+
+  write(go[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: memory changed while in swap\n", s);
+    exit(1);
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2931,6 +3526,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swap"},
     
   { 0, 0},
 };
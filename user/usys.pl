@@ -45,4 +45,10 @@ entry("getswapcount");
 # system calls for cfs
 entry("nice");
 entry("startcfs");
-entry("stopcfs");
\ No newline at end of file
+entry("stopcfs");
+entry("mmap");
+entry("munmap");
+entry("shm_open");
+entry("shm_attach");
+entry("spawn");
+entry("bcachestat");